@@ -118,17 +118,19 @@ uint16_t csum_fold(uint32_t sum)
 /**
  * csum_ip4_header() - Calculate IPv4 header checksum
  * @tot_len:	IPv4 payload length (data + IP header, network order)
+ * @tos:	Type of Service
  * @protocol:	Protocol number (network order)
  * @saddr:	IPv4 source address (network order)
  * @daddr:	IPv4 destination address (network order)
  *
  * Return: 16-bit folded sum of the IPv4 header
  */
-uint16_t csum_ip4_header(uint16_t tot_len, uint8_t protocol,
+uint16_t csum_ip4_header(uint16_t tot_len, uint8_t tos, uint8_t protocol,
 			 struct in_addr saddr, struct in_addr daddr)
 {
 	uint32_t sum = L2_BUF_IP4_PSUM(protocol);
 
+	sum += htons(tos);
 	sum += tot_len;
 	sum += (saddr.s_addr >> 16) & 0xffff;
 	sum += saddr.s_addr & 0xffff;
@@ -13,7 +13,7 @@ struct icmp6hdr;
 uint32_t sum_16b(const void *buf, size_t len);
 uint16_t csum_fold(uint32_t sum);
 uint16_t csum_unaligned(const void *buf, size_t len, uint32_t init);
-uint16_t csum_ip4_header(uint16_t tot_len, uint8_t protocol,
+uint16_t csum_ip4_header(uint16_t tot_len, uint8_t tos, uint8_t protocol,
 			 struct in_addr saddr, struct in_addr daddr);
 uint32_t proto_ipv4_header_psum(uint16_t tot_len, uint8_t protocol,
 				struct in_addr saddr, struct in_addr daddr);
@@ -33,6 +33,7 @@
 #include <time.h>
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
+#include <linux/capability.h>
 
 #include "util.h"
 #include "ip.h"
@@ -40,6 +41,8 @@
 #include "netlink.h"
 #include "udp.h"
 #include "tcp.h"
+#include "siphash.h"
+#include "inany.h"
 #include "pasta.h"
 #include "lineread.h"
 #include "isolation.h"
@@ -105,6 +108,279 @@ static int parse_port_range(const char *s, char **endptr,
 	return 0;
 }
 
+/**
+ * conf_cpus() - Parse list of CPUs, as comma-separated CPU numbers or ranges
+ * @optarg:	Option argument (CPU list, e.g. 0-3,8)
+ * @cpus:	CPU set to fill
+ *
+ * Return: 0 on success, -EINVAL if the list is not valid
+ */
+static int conf_cpus(const char *optarg, cpu_set_t *cpus)
+{
+	const char *p = optarg;
+
+	CPU_ZERO(cpus);
+
+	do {
+		unsigned long first, last, i;
+		char *end;
+
+		last = first = strtoul(p, &end, 10);
+		if (end == p)
+			return -EINVAL;
+
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p)
+				return -EINVAL;
+		}
+
+		if ((*end != '\0' && *end != ',') ||
+		    last < first || last >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (i = first; i <= last; i++)
+			CPU_SET(i, cpus);
+	} while ((p = next_chunk(p, ',')));
+
+	return 0;
+}
+
+/**
+ * conf_nat_addr() - Parse IPv4 or IPv6 address for translation rule
+ * @s:		String to parse
+ * @addr:	Address to fill, IPv4-mapped for IPv4
+ *
+ * Return: AF_INET or AF_INET6, AF_UNSPEC if @s is not a valid address
+ */
+static sa_family_t conf_nat_addr(const char *s, struct in6_addr *addr)
+{
+	struct in_addr addr4;
+
+	if (inet_pton(AF_INET, s, &addr4)) {
+		inany_from_af((union inany_addr *)addr, AF_INET, &addr4);
+		return AF_INET;
+	}
+
+	if (inet_pton(AF_INET6, s, addr))
+		return AF_INET6;
+
+	return AF_UNSPEC;
+}
+
+/**
+ * conf_nat() - Parse address and port translation rule, add it to table
+ * @c:		Execution context
+ * @optarg:	Rule, PIF,PROTO,PREFIX[/LEN],FIRST[-LAST],ADDR[,PORT]
+ */
+static void conf_nat(struct ctx *c, const char *optarg)
+{
+	char buf[BUFSIZ], *field[6] = { buf }, *p, *end;
+	struct fwd_nat_rule rule = { 0 };
+	struct port_range range;
+	unsigned long len, port;
+	sa_family_t af;
+	int n = 1;
+
+	if (strlen(optarg) >= sizeof(buf))
+		goto bad;
+
+	strcpy(buf, optarg);
+	for (p = buf; (p = strchr(p, ',')); ) {
+		if (n == ARRAY_SIZE(field))
+			goto bad;
+
+		*p++ = 0;
+		field[n++] = p;
+	}
+	if (n < 5)
+		goto bad;
+
+	if (!strcasecmp(field[0], pif_type(PIF_TAP)))
+		rule.pif = PIF_TAP;
+	else if (!strcasecmp(field[0], pif_type(PIF_HOST)))
+		rule.pif = PIF_HOST;
+	else
+		goto bad;
+
+	if (strcmp(field[1], "tcp"))
+		goto bad;
+	rule.proto = IPPROTO_TCP;
+
+	if ((p = strchr(field[2], '/')))
+		*p++ = 0;
+
+	if ((af = conf_nat_addr(field[2], &rule.prefix)) == AF_UNSPEC)
+		goto bad;
+
+	len = af == AF_INET ? 32 : 128;
+	if (p) {
+		unsigned long l = strtoul(p, &end, 10);
+
+		if (end == p || *end || l > len)
+			goto bad;
+		len = l;
+	}
+	rule.prefix_len = af == AF_INET ? 96 + len : len;
+
+	if (parse_port_range(field[3], &end, &range) || *end)
+		goto bad;
+	rule.first = range.first;
+	rule.last = range.last;
+
+	if (conf_nat_addr(field[4], &rule.addr) != af)
+		goto bad;
+
+	if (n == 6) {
+		port = strtoul(field[5], &end, 10);
+		if (end == field[5] || *end || !port ||
+		    port + (range.last - range.first) >= NUM_PORTS)
+			goto bad;
+		rule.port = port;
+	}
+
+	if (fwd_nat_add(&c->nat, &rule))
+		die("Too many translation rules, maximum is %i",
+		    FWD_NAT_RULES_MAX);
+
+	return;
+bad:
+	die("Invalid translation rule: %s", optarg);
+}
+
+/**
+ * conf_rate() - Parse rate limit for data from guest
+ * @b:		Token bucket to configure
+ * @optarg:	Rate in bits per second, optional k, M, G suffix, burst in bytes
+ *		after a comma
+ *
+ * Return: 0 on success, -EINVAL if the specification is not valid
+ */
+static int conf_rate(struct rate_bucket *b, const char *optarg)
+{
+	unsigned long long rate, burst, mult = 1;
+	char *end;
+
+	errno = 0;
+	rate = strtoull(optarg, &end, 10);
+	if (end == optarg || errno)
+		return -EINVAL;
+
+	if (*end == 'k')
+		mult = 1000;
+	else if (*end == 'M')
+		mult = 1000 * 1000;
+	else if (*end == 'G')
+		mult = 1000 * 1000 * 1000;
+
+	if (mult > 1)
+		end++;
+
+	if (rate > RATE_MAX * 8 / mult || !(rate = rate * mult / 8))
+		return -EINVAL;
+
+	/* Default burst: 100 ms worth of data, at least a 64 KiB window */
+	burst = MAX(rate / 10, 65536ULL);
+	if (*end == ',') {
+		const char *p = end + 1;
+
+		burst = strtoull(p, &end, 10);
+		if (end == p || errno || !burst || burst > RATE_MAX)
+			return -EINVAL;
+	}
+
+	if (*end)
+		return -EINVAL;
+
+	b->rate = rate;
+	b->tokens = b->burst = burst;
+
+	return 0;
+}
+
+/**
+ * conf_pool_out() - Parse outbound source addresses, add them to pools
+ * @c:		Execution context
+ * @optarg:	Comma-separated list of ADDR[%IFNAME]
+ */
+static void conf_pool_out(struct ctx *c, const char *optarg)
+{
+	char buf[BUFSIZ], *p, *next, *ifname;
+
+	if (strlen(optarg) >= sizeof(buf))
+		goto bad;
+
+	strcpy(buf, optarg);
+	for (p = buf; p; p = next) {
+		struct in6_addr addr6;
+		struct in_addr addr4;
+		char *ifn;
+
+		if ((next = strchr(p, ',')))
+			*next++ = 0;
+
+		if ((ifname = strchr(p, '%'))) {
+			*ifname++ = 0;
+			if (!*ifname || strlen(ifname) >= IFNAMSIZ)
+				goto bad;
+		}
+
+		if (inet_pton(AF_INET, p, &addr4)	&&
+		    !IN4_IS_ADDR_UNSPECIFIED(&addr4)	&&
+		    !IN4_IS_ADDR_BROADCAST(&addr4)	&&
+		    !IN4_IS_ADDR_MULTICAST(&addr4)) {
+			if (c->ip4.pool_out_n == OUT_POOL_MAX)
+				goto full;
+
+			c->ip4.pool_out[c->ip4.pool_out_n] = addr4;
+			ifn = c->ip4.pool_ifname_out[c->ip4.pool_out_n++];
+		} else if (inet_pton(AF_INET6, p, &addr6)	&&
+			   !IN6_IS_ADDR_UNSPECIFIED(&addr6)	&&
+			   !IN6_IS_ADDR_LOOPBACK(&addr6)	&&
+			   !IN6_IS_ADDR_V4MAPPED(&addr6)	&&
+			   !IN6_IS_ADDR_V4COMPAT(&addr6)	&&
+			   !IN6_IS_ADDR_MULTICAST(&addr6)) {
+			if (c->ip6.pool_out_n == OUT_POOL_MAX)
+				goto full;
+
+			c->ip6.pool_out[c->ip6.pool_out_n] = addr6;
+			ifn = c->ip6.pool_ifname_out[c->ip6.pool_out_n++];
+		} else {
+			goto bad;
+		}
+
+		if (ifname)
+			strcpy(ifn, ifname);
+	}
+
+	return;
+full:
+	die("Too many outbound pool addresses, maximum is %i per IP version",
+	    OUT_POOL_MAX);
+bad:
+	die("Invalid outbound pool address: %s", optarg);
+}
+
+/**
+ * conf_ports_unpriv_start() - Get first port we can bind without privileges
+ *
+ * Return: value of net.ipv4.ip_unprivileged_port_start, 1024 if unavailable,
+ *	   0 if we have CAP_NET_BIND_SERVICE: EACCES comes from something else
+ *	   then (e.g. a Linux Security Module), and might be specific to a port
+ */
+static unsigned conf_ports_unpriv_start(void)
+{
+	intmax_t v;
+
+	if (isolate_has_cap(CAP_NET_BIND_SERVICE))
+		return 0;
+
+	v = read_file_integer("/proc/sys/net/ipv4/ip_unprivileged_port_start",
+			      1024);
+	return MIN(MAX(v, 0), NUM_PORTS);
+}
+
 /**
  * conf_ports() - Parse port configuration options, initialise UDP/TCP sockets
  * @c:		Execution context
@@ -120,7 +396,7 @@ static void conf_ports(const struct ctx *c, char optname, const char *optarg,
 	bool exclude_only = true, bound_one = false;
 	uint8_t exclude[PORT_BITMAP_SIZE] = { 0 };
 	sa_family_t af = AF_UNSPEC;
-	unsigned i;
+	unsigned i, unpriv = 0;
 	int ret;
 
 	if (!strcmp(optarg, "none")) {
@@ -153,11 +429,19 @@ static void conf_ports(const struct ctx *c, char optname, const char *optarg,
 		memset(fwd->map, 0xff, PORT_EPHEMERAL_MIN / 8);
 
 		for (i = 0; i < PORT_EPHEMERAL_MIN; i++) {
+			/* Once we failed to bind a privileged port, skip the
+			 * rest of them, instead of trying (and failing) again
+			 */
+			if (i < unpriv)
+				continue;
+
 			if (optname == 't') {
 				ret = tcp_sock_init(c, AF_UNSPEC, NULL, NULL,
 						    i);
 				if (ret == -ENFILE || ret == -EMFILE)
 					goto enfile;
+				if (ret == -EACCES)
+					unpriv = conf_ports_unpriv_start();
 				if (!ret)
 					bound_one = true;
 			} else if (optname == 'u') {
@@ -165,6 +449,8 @@ static void conf_ports(const struct ctx *c, char optname, const char *optarg,
 						    i);
 				if (ret == -ENFILE || ret == -EMFILE)
 					goto enfile;
+				if (ret == -EACCES)
+					unpriv = conf_ports_unpriv_start();
 				if (!ret)
 					bound_one = true;
 			}
@@ -249,16 +535,23 @@ static void conf_ports(const struct ctx *c, char optname, const char *optarg,
 
 			bitmap_set(fwd->map, i);
 
+			if (i < unpriv)
+				continue;
+
 			if (optname == 't') {
 				ret = tcp_sock_init(c, af, addr, ifname, i);
 				if (ret == -ENFILE || ret == -EMFILE)
 					goto enfile;
+				if (ret == -EACCES)
+					unpriv = conf_ports_unpriv_start();
 				if (!ret)
 					bound_one = true;
 			} else if (optname == 'u') {
 				ret = udp_sock_init(c, 0, af, addr, ifname, i);
 				if (ret == -ENFILE || ret == -EMFILE)
 					goto enfile;
+				if (ret == -EACCES)
+					unpriv = conf_ports_unpriv_start();
 				if (!ret)
 					bound_one = true;
 			} else {
@@ -734,6 +1027,10 @@ static void print_usage(const char *name, int status)
 	info(   "    default: drop to user \"nobody\"");
 	info(   "  -h, --help		Display this help message and exit");
 	info(   "  --version		Show version and exit");
+	info(   "  --busy-poll USECS	Keep polling for USECS after activity");
+	info(   "    default: 0 (disabled), maximum: %i", BUSY_POLL_MAX);
+	info(   "  --cpus LIST		Run on given CPUs, e.g. 0-3,8, and");
+	info(   "    allocate buffers on their memory nodes");
 
 	if (strstr(name, "pasta")) {
 		info(   "  -I, --ns-ifname NAME	namespace interface name");
@@ -742,6 +1039,10 @@ static void print_usage(const char *name, int status)
 		info(   "  -s, --socket PATH	UNIX domain socket path");
 		info(   "    default: probe free path starting from "
 		     UNIX_SOCK_PATH, 1);
+		info(   "  --socket-type TYPE	UNIX domain socket type:");
+		info(   "    'stream': frames with length header (qemu stream)");
+		info(   "    'seqpacket', 'dgram': one frame per message");
+		info(   "    default: stream");
 	}
 
 	info(   "  -F, --fd FD		Use FD as pre-opened connected socket");
@@ -770,6 +1071,11 @@ static void print_usage(const char *name, int status)
 	info(   "    default: use interface from default route");
 	info(   "  --outbound-if6 NAME	Bind to outbound interface for IPv6");
 	info(   "    default: use interface from default route");
+	info(   "  --outbound-pool ADDR[%%IFNAME][,ADDR...]");
+	info(   "    Spread outbound TCP connections over source addresses");
+	info(   "    can be specified multiple times, up to %i per IP version",
+		OUT_POOL_MAX);
+	info(   "    default: use a single source address, see --outbound");
 	info(   "  -D, --dns ADDR	Use IPv4 or IPv6 address as DNS");
 	info(   "    can be specified multiple times");
 	info(   "    a single, empty option disables DNS information");
@@ -807,6 +1113,21 @@ static void print_usage(const char *name, int status)
 	info(   "  --no-dhcpv6		Disable DHCPv6 server");
 	info(   "  --no-ra		Disable router advertisements");
 	info(   "  --no-map-gw		Don't map gateway address to host");
+	info(   "  --tcp-fastopen	Complete guest handshakes right away,");
+	info(   "    then connect using TCP Fast Open where possible");
+	info(   "  --tcp-queue-delay MS	Clamp window to guest to keep data");
+	info(   "    queued in host sockets below MS milliseconds");
+	info(   "    default: clamp window to socket buffer only");
+	info(   "  --nat RULE		Translate addresses and ports of new flows");
+	info(   "    can be specified multiple times");
+	info(   "    RULE is PIF,PROTO,PREFIX[/LEN],PORTS,ADDR[,PORT]:");
+	info(   "      'tap': destination of connections from guest, or");
+	info(   "      'host': source of connections to guest, seen by guest");
+	info(   "    PROTO can only be 'tcp', PORTS is a port or a range");
+	info(   "    default: no translation, most specific prefix wins");
+	info(   "  --rate-limit RATE[,BURST]	Limit data rate from guest");
+	info(   "    RATE in bit/s, with optional k, M, G suffix");
+	info(   "    BURST in bytes, default: 100 ms at RATE, at least 64 KiB");
 	info(   "  -4, --ipv4-only	Enable IPv4 operation only");
 	info(   "  -6, --ipv6-only	Enable IPv6 operation only");
 
@@ -888,6 +1209,8 @@ pasta_opts:
 	info(   "  --no-copy-addrs	DEPRECATED:");
 	info(   "			Don't copy all addresses to namespace");
 	info(   "  --ns-mac-addr ADDR	Set MAC address on tap interface");
+	info(   "  --tap-queues COUNT	Number of queues for tap interface");
+	info(   "    default: 1, maximum: %i", TAP_QUEUES_MAX);
 
 	exit(status);
 }
@@ -937,6 +1260,20 @@ static void conf_print(const struct ctx *c)
 		     inet_ntop(AF_INET6, &c->ip6.addr_out, buf6, sizeof(buf6)));
 	}
 
+	for (i = 0; i < c->ip4.pool_out_n; i++) {
+		info("Outbound pool: %s%s%s",
+		     inet_ntop(AF_INET, &c->ip4.pool_out[i], buf4, sizeof(buf4)),
+		     *c->ip4.pool_ifname_out[i] ? "%" : "",
+		     c->ip4.pool_ifname_out[i]);
+	}
+
+	for (i = 0; i < c->ip6.pool_out_n; i++) {
+		info("Outbound pool: %s%s%s",
+		     inet_ntop(AF_INET6, &c->ip6.pool_out[i], buf6, sizeof(buf6)),
+		     *c->ip6.pool_ifname_out[i] ? "%" : "",
+		     c->ip6.pool_ifname_out[i]);
+	}
+
 	if (c->mode == MODE_PASTA)
 		info("Namespace interface: %s", c->pasta_ifn);
 
@@ -1173,6 +1510,15 @@ void conf(struct ctx *c, int argc, char **argv)
 		{"config-net",	no_argument,		NULL,		17 },
 		{"no-copy-routes", no_argument,		NULL,		18 },
 		{"no-copy-addrs", no_argument,		NULL,		19 },
+		{"tap-queues",	required_argument,	NULL,		20 },
+		{"busy-poll",	required_argument,	NULL,		21 },
+		{"cpus",	required_argument,	NULL,		22 },
+		{"tcp-fastopen", no_argument,		NULL,		23 },
+		{"nat",		required_argument,	NULL,		24 },
+		{"rate-limit",	required_argument,	NULL,		25 },
+		{"tcp-queue-delay", required_argument,	NULL,		26 },
+		{"socket-type",	required_argument,	NULL,		27 },
+		{"outbound-pool", required_argument,	NULL,		28 },
 		{ 0 },
 	};
 	char userns[PATH_MAX] = { 0 }, netns[PATH_MAX] = { 0 };
@@ -1201,6 +1547,7 @@ void conf(struct ctx *c, int argc, char **argv)
 
 	c->tcp.fwd_in.mode = c->tcp.fwd_out.mode = 0;
 	c->udp.fwd_in.f.mode = c->udp.fwd_out.f.mode = 0;
+	c->sock_type = SOCK_STREAM;
 
 	do {
 		name = getopt_long(argc, argv, optstring, options, NULL);
@@ -1354,6 +1701,75 @@ void conf(struct ctx *c, int argc, char **argv)
 			warn("--no-copy-addrs will be dropped soon");
 			c->no_copy_addrs = copy_addrs_opt = true;
 			break;
+		case 20:
+			if (c->mode != MODE_PASTA)
+				die("--tap-queues is for pasta mode only");
+
+			errno = 0;
+			c->tap_queues = strtol(optarg, NULL, 0);
+
+			if (c->tap_queues < 1 || c->tap_queues > TAP_QUEUES_MAX ||
+			    errno)
+				die("Invalid number of tap queues: %s", optarg);
+
+			break;
+		case 21:
+			errno = 0;
+			c->busy_poll = strtol(optarg, NULL, 0);
+
+			if (c->busy_poll < 0 || c->busy_poll > BUSY_POLL_MAX ||
+			    errno)
+				die("Invalid busy polling time: %s", optarg);
+
+			break;
+		case 22:
+			if (CPU_COUNT(&c->cpus))
+				die("Multiple --cpus options given");
+
+			if (conf_cpus(optarg, &c->cpus) || !CPU_COUNT(&c->cpus))
+				die("Invalid CPU list: %s", optarg);
+
+			break;
+		case 23:
+			c->tcp.fastopen = true;
+			break;
+		case 24:
+			conf_nat(c, optarg);
+			break;
+		case 25:
+			if (c->tap_rate.rate)
+				die("Multiple --rate-limit options given");
+
+			if (conf_rate(&c->tap_rate, optarg))
+				die("Invalid rate limit: %s", optarg);
+
+			break;
+		case 26:
+			errno = 0;
+			c->tcp.queue_delay = strtol(optarg, NULL, 0);
+
+			if (c->tcp.queue_delay < 1 ||
+			    c->tcp.queue_delay > QUEUE_DELAY_MAX || errno)
+				die("Invalid TCP queueing delay: %s", optarg);
+
+			break;
+		case 27:
+			if (c->mode != MODE_PASST)
+				die("--socket-type is for passt mode only");
+
+			if (!strcmp(optarg, "stream"))
+				c->sock_type = SOCK_STREAM;
+			else if (!strcmp(optarg, "seqpacket"))
+				c->sock_type = SOCK_SEQPACKET;
+			else if (!strcmp(optarg, "dgram"))
+				c->sock_type = SOCK_DGRAM;
+			else
+				die("Invalid socket type: %s", optarg);
+
+			break;
+		case 28:
+			conf_pool_out(c, optarg);
+			break;
 		case 'd':
 			if (c->debug)
 				die("Multiple --debug options given");
@@ -1645,6 +2061,9 @@ void conf(struct ctx *c, int argc, char **argv)
 	if (*c->sock_path && c->fd_tap >= 0)
 		die("Options --socket and --fd are mutually exclusive");
 
+	if (c->tap_queues > 1 && c->fd_tap >= 0)
+		die("Options --tap-queues and --fd are mutually exclusive");
+
 	if (c->mode == MODE_PASTA && !c->pasta_conf_ns) {
 		if (copy_routes_opt)
 			die("--no-copy-routes needs --config-net");
@@ -1652,6 +2071,13 @@ void conf(struct ctx *c, int argc, char **argv)
 			die("--no-copy-addrs needs --config-net");
 	}
 
+	/* UDP and ICMP flows don't use the pool: bind them to its first entry */
+	if (c->ip4.pool_out_n && IN4_IS_ADDR_UNSPECIFIED(&c->ip4.addr_out))
+		c->ip4.addr_out = c->ip4.pool_out[0];
+
+	if (c->ip6.pool_out_n && IN6_IS_ADDR_UNSPECIFIED(&c->ip6.addr_out))
+		c->ip6.addr_out = c->ip6.pool_out[0];
+
 	if (!ifi4 && *c->ip4.ifname_out)
 		ifi4 = if_nametoindex(c->ip4.ifname_out);
 
@@ -37,6 +37,17 @@ const uint8_t flow_proto[] = {
 static_assert(ARRAY_SIZE(flow_proto) == FLOW_NUM_TYPES,
 	      "flow_proto[] doesn't match enum flow_type");
 
+/* Approximate count of file descriptors used by flows of each type */
+static const unsigned flow_files[] = {
+	[FLOW_TYPE_NONE]	= 0,
+	[FLOW_TCP]		= 2,	/* Socket and timer */
+	[FLOW_TCP_SPLICE]	= 6,	/* Two sockets, two pipes */
+	[FLOW_PING4]		= 1,
+	[FLOW_PING6]		= 1,
+};
+static_assert(ARRAY_SIZE(flow_files) == FLOW_NUM_TYPES,
+	      "flow_files[] doesn't match enum flow_type");
+
 /* Global Flow Table */
 
 /**
@@ -136,6 +147,32 @@ union flow flowtab[FLOW_MAX];
 /* Last time the flow timers ran */
 static struct timespec flow_timer_run;
 
+/**
+ * DOC: Theory of Operation - flow table and file pressure
+ *
+ * Flows record their last activity (FLOW_TOUCH()), in seconds, in
+ * flow_activity[]. As the flow timer runs, we count flows, estimate the file
+ * descriptors they use, and build a histogram of idle times.
+ *
+ * If flows exceed FLOW_TABLE_PRESSURE percent of the table, or their files
+ * FLOW_FILE_PRESSURE percent of the limit, we pick the smallest idle time such
+ * that evicting flows idle for at least that long brings us back below the
+ * threshold (approximately, as a least recently used policy would), but not
+ * less than FLOW_PRESSURE_IDLE_MIN. On the next timer runs, flows idle for
+ * longer are reset (TCP) or closed (spliced TCP). Pools of pre-opened sockets
+ * and pipes are not refilled meanwhile.
+ */
+
+uint32_t flow_activity[FLOW_MAX];
+uint32_t flow_now;
+
+/* Evict flows idle for at least this long, seconds, zero if no pressure */
+static unsigned flow_evict_idle;
+
+/* Counters for current pressure episode, flows evicted, failed allocations */
+static unsigned long flow_evicted;
+static unsigned long flow_alloc_failed;
+
 /** flow_log_ - Log flow-related message
  * @f:		flow the message is related to
  * @pri:	Log priority
@@ -170,6 +207,7 @@ union flow *flow_start(union flow *flow, enum flow_type type,
 {
 	(void)iniside;
 	flow->f.type = type;
+	FLOW_TOUCH(flow);
 	flow_dbg(flow, "START %s", flow_type_str[flow->f.type]);
 	return flow;
 }
@@ -196,8 +234,10 @@ union flow *flow_alloc(void)
 {
 	union flow *flow = &flowtab[flow_first_free];
 
-	if (flow_first_free >= FLOW_MAX)
+	if (flow_first_free >= FLOW_MAX) {
+		flow_alloc_failed++;
 		return NULL;
+	}
 
 	ASSERT(flow->f.type == FLOW_TYPE_NONE);
 	ASSERT(flow->free.n >= 1);
@@ -244,18 +284,102 @@ void flow_alloc_cancel(union flow *flow)
 	flow_first_free = FLOW_IDX(flow);
 }
 
+/**
+ * flow_under_pressure() - Check if flow table or files are under pressure
+ *
+ * Return: true if we're currently evicting idle flows
+ */
+bool flow_under_pressure(void)
+{
+	return flow_evict_idle;
+}
+
+/**
+ * flow_evict() - Reset or close idle flow, if flow type supports it
+ * @c:		Execution context
+ * @flow:	Flow to evict
+ *
+ * Return: true if the flow is now closing, false otherwise
+ */
+static bool flow_evict(struct ctx *c, union flow *flow)
+{
+	switch (flow->f.type) {
+	case FLOW_TCP:
+		return tcp_flow_evict(c, flow);
+	case FLOW_TCP_SPLICE:
+		return tcp_splice_flow_evict(c, flow);
+	default:
+		/* Ping flows expire on their own, quickly enough */
+		return false;
+	}
+}
+
+/**
+ * flow_pressure_update() - Set idle time for eviction from flow counts, log
+ * @c:		Execution context
+ * @flows:	Number of active flows
+ * @files:	Estimated number of files used by flows
+ * @hist:	Histogram of flows by idle time, log2 of seconds
+ */
+static void flow_pressure_update(const struct ctx *c, unsigned flows,
+				 unsigned files, const unsigned *hist)
+{
+	unsigned max_flows = (unsigned)FLOW_MAX * FLOW_TABLE_PRESSURE / 100;
+	unsigned max_files = (unsigned)c->nofile * FLOW_FILE_PRESSURE / 100;
+	unsigned excess = 0, sum = 0;
+	int b;
+
+	if (flows > max_flows)
+		excess = flows - max_flows;
+
+	if (files > max_files)
+		excess = MAX(excess, DIV_ROUND_UP((files - max_files) * flows,
+						  files));
+
+	if (!excess) {
+		if (flow_evict_idle) {
+			info("Flow pressure over: %u flows, ~%u files, "
+			     "%lu flows evicted, %lu allocations failed",
+			     flows, files, flow_evicted, flow_alloc_failed);
+		}
+
+		flow_evict_idle = 0;
+		flow_evicted = flow_alloc_failed = 0;
+		return;
+	}
+
+	for (b = FLOW_IDLE_BUCKETS - 1; b > 0; b--) {
+		sum += hist[b];
+		if (sum >= excess)
+			break;
+	}
+
+	if (!flow_evict_idle) {
+		warn("Flow pressure: %u flows, ~%u files, evicting idle flows",
+		     flows, files);
+	}
+
+	flow_evict_idle = MAX(1U << b, FLOW_PRESSURE_IDLE_MIN);
+	debug("Flow pressure: evicting flows idle for %us or longer",
+	      flow_evict_idle);
+}
+
 /**
  * flow_defer_handler() - Handler for per-flow deferred and timed tasks
  * @c:		Execution context
  * @now:	Current timestamp
  */
-void flow_defer_handler(const struct ctx *c, const struct timespec *now)
+void flow_defer_handler(struct ctx *c, const struct timespec *now)
 {
 	struct flow_free_cluster *free_head = NULL;
+	unsigned hist[FLOW_IDLE_BUCKETS] = { 0 };
 	unsigned *last_next = &flow_first_free;
+	unsigned flows = 0, files = 0;
 	bool timer = false;
 	unsigned idx;
 
+	flow_now = now->tv_sec;
+
 	if (timespec_diff_ms(now, &flow_timer_run) >= FLOW_TIMER_INTERVAL) {
 		timer = true;
 		flow_timer_run = *now;
@@ -287,12 +411,26 @@ void flow_defer_handler(const struct ctx *c, const struct timespec *now)
 			continue;
 		}
 
+		if (timer) {
+			uint32_t idle = flow_now - flow_activity[idx];
+			int b = MIN(fls(idle), FLOW_IDLE_BUCKETS - 1);
+
+			if (flow_evict_idle && idle >= flow_evict_idle &&
+			    flow_evict(c, flow)) {
+				flow_evicted++;
+			} else {
+				flows++;
+				files += flow_files[flow->f.type];
+				hist[MAX(b, 0)]++;
+			}
+		}
+
 		switch (flow->f.type) {
 		case FLOW_TYPE_NONE:
 			ASSERT(false);
 			break;
 		case FLOW_TCP:
-			closed = tcp_flow_defer(flow);
+			closed = tcp_flow_defer(c, flow);
 			break;
 		case FLOW_TCP_SPLICE:
 			closed = tcp_splice_flow_defer(flow);
@@ -330,6 +468,9 @@ void flow_defer_handler(const struct ctx *c, const struct timespec *now)
 	}
 
 	*last_next = FLOW_MAX;
+
+	if (timer)
+		flow_pressure_update(c, flows, files, hist);
 }
 
 /**
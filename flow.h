@@ -48,6 +48,8 @@ struct flow_common {
 
 #define FLOW_TABLE_PRESSURE		30	/* % of FLOW_MAX */
 #define FLOW_FILE_PRESSURE		30	/* % of c->nofile */
+#define FLOW_PRESSURE_IDLE_MIN		10	/* s, don't evict if more recent */
+#define FLOW_IDLE_BUCKETS		16	/* log2 buckets of idle seconds */
 
 union flow *flow_start(union flow *flow, enum flow_type type,
 		       unsigned iniside);
@@ -82,7 +84,8 @@ static inline bool flow_sidx_eq(flow_sidx_t a, flow_sidx_t b)
 union flow;
 
 void flow_init(void);
-void flow_defer_handler(const struct ctx *c, const struct timespec *now);
+bool flow_under_pressure(void);
+void flow_defer_handler(struct ctx *c, const struct timespec *now);
 
 void flow_log_(const struct flow_common *f, int pri, const char *fmt, ...)
 	__attribute__((format(printf, 3, 4)));
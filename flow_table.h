@@ -40,6 +40,8 @@ union flow {
 /* Global Flow Table */
 extern unsigned flow_first_free;
 extern union flow flowtab[];
+extern uint32_t flow_activity[];
+extern uint32_t flow_now;
 
 
 /** flow_idx - Index of flow from common structure
@@ -59,6 +61,11 @@ static inline unsigned flow_idx(const struct flow_common *f)
  */
 #define FLOW_IDX(f_)		(flow_idx(&(f_)->f))
 
+/** FLOW_TOUCH - Record activity on a flow, for eviction of idle flows
+ * @f_:	Flow pointer, either union flow * or protocol specific
+ */
+#define FLOW_TOUCH(f_)		(flow_activity[FLOW_IDX(f_)] = flow_now)
+
 /** FLOW - Flow entry at a given index
  * @idx:	Flow index
  *
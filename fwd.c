@@ -6,7 +6,7 @@
  * PASTA - Pack A Subtle Tap Abstraction
  *  for network namespace/tap device mode
  *
- * fwd.c - Port forwarding helpers
+ * fwd.c - Port forwarding and address translation helpers
  *
  * Copyright Red Hat
  * Author: Stefano Brivio <sbrivio@redhat.com>
@@ -19,6 +19,7 @@
 #include <sched.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <netinet/in.h>
 
@@ -156,3 +157,101 @@ void fwd_scan_ports_init(struct ctx *c)
 				   &c->tcp.fwd_out, &c->tcp.fwd_in);
 	}
 }
+
+/**
+ * fwd_nat_add() - Add translation rule to table, keeping it sorted
+ * @nat:	Translation rule table
+ * @rule:	Rule to add
+ *
+ * Rules with longer prefixes are stored first, so that the first match found
+ * by fwd_nat_lookup() is the most specific one. Rules with the same prefix
+ * length are kept in the order they were given.
+ *
+ * Return: 0 on success, -ENOSPC if the table is full
+ */
+int fwd_nat_add(struct fwd_nat *nat, const struct fwd_nat_rule *rule)
+{
+	int i, port;
+
+	if (nat->count >= FWD_NAT_RULES_MAX)
+		return -ENOSPC;
+
+	for (i = nat->count; i > 0; i--) {
+		if (nat->rules[i - 1].prefix_len >= rule->prefix_len)
+			break;
+		nat->rules[i] = nat->rules[i - 1];
+	}
+	nat->rules[i] = *rule;
+	nat->count++;
+
+	for (port = rule->first; port <= rule->last; port++)
+		bitmap_set(nat->map[rule->pif], port);
+
+	return 0;
+}
+
+/**
+ * fwd_nat_prefix_match() - Check if address matches a given prefix
+ * @addr:	Address to check
+ * @prefix:	Prefix
+ * @len:	Prefix length, in bits
+ *
+ * Return: true if the first @len bits of @addr and @prefix are the same
+ */
+static bool fwd_nat_prefix_match(const struct in6_addr *addr,
+				 const struct in6_addr *prefix, int len)
+{
+	const uint8_t *a = addr->s6_addr, *p = prefix->s6_addr;
+	int bytes = len / 8, bits = len % 8;
+
+	if (memcmp(a, p, bytes))
+		return false;
+
+	if (!bits)
+		return true;
+
+	return !((a[bytes] ^ p[bytes]) & (0xff << (8 - bits)));
+}
+
+/**
+ * fwd_nat_lookup() - Translate address and port for a new flow, if needed
+ * @nat:	Translation rule table
+ * @pif:	Interface the flow is initiated from
+ * @proto:	IP protocol number
+ * @addr:	Destination (PIF_TAP) or source (PIF_HOST) address, IPv4-mapped
+ *		for IPv4, updated on match
+ * @port:	Destination or source port, updated on match
+ *
+ * This is called once, on flow creation, and the outcome is kept by the flow
+ * itself. The per-interface port bitmap makes the common case, where no rule
+ * can possibly match, a single bit test.
+ *
+ * Return: true if a rule matched, and @addr and @port were translated
+ */
+bool fwd_nat_lookup(const struct fwd_nat *nat, uint8_t pif, uint8_t proto,
+		    struct in6_addr *addr, in_port_t *port)
+{
+	int i;
+
+	if (!nat->count || pif >= PIF_NUM_TYPES ||
+	    !bitmap_isset(nat->map[pif], *port))
+		return false;
+
+	for (i = 0; i < nat->count; i++) {
+		const struct fwd_nat_rule *rule = &nat->rules[i];
+
+		if (rule->pif != pif || rule->proto != proto ||
+		    *port < rule->first || *port > rule->last ||
+		    !fwd_nat_prefix_match(addr, &rule->prefix,
+					  rule->prefix_len))
+			continue;
+
+		*addr = rule->addr;
+		if (rule->port)
+			*port = rule->port + (*port - rule->first);
+
+		return true;
+	}
+
+	return false;
+}
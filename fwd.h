@@ -9,6 +9,8 @@
 
 #include <netinet/in.h>
 
+#include "pif.h"
+
 /* Number of ports for both TCP and UDP */
 #define	NUM_PORTS	(1U << 16)
 
@@ -37,10 +39,50 @@ struct fwd_ports {
 	in_port_t delta[NUM_PORTS];
 };
 
+#define FWD_NAT_RULES_MAX	32
+
+/**
+ * struct fwd_nat_rule - Address and port translation rule for new flows
+ * @pif:	Interface initiating the flow: for PIF_TAP, the destination is
+ *		translated, for PIF_HOST, the source address seen by the guest
+ * @proto:	IP protocol number
+ * @prefix_len:	Length of @prefix in bits, IPv4 prefixes are IPv4-mapped
+ * @prefix:	Address prefix to match (IPv4-mapped for IPv4)
+ * @first:	First port to match
+ * @last:	Last port to match (inclusive)
+ * @addr:	Translated address (IPv4-mapped for IPv4)
+ * @port:	Translated port for @first, 0 to keep port numbers unchanged
+ */
+struct fwd_nat_rule {
+	uint8_t pif;
+	uint8_t proto;
+	uint8_t prefix_len;
+	struct in6_addr prefix;
+	in_port_t first;
+	in_port_t last;
+	struct in6_addr addr;
+	in_port_t port;
+};
+
+/**
+ * fwd_nat - Table of translation rules, most specific prefixes first
+ * @count:	Number of rules in table
+ * @map:	Bitmap of ports matched by any rule, for each interface
+ * @rules:	Rules, sorted by decreasing prefix length, then in given order
+ */
+struct fwd_nat {
+	int count;
+	uint8_t map[PIF_NUM_TYPES][PORT_BITMAP_SIZE];
+	struct fwd_nat_rule rules[FWD_NAT_RULES_MAX];
+};
+
 void fwd_scan_ports_tcp(struct fwd_ports *fwd, const struct fwd_ports *rev);
 void fwd_scan_ports_udp(struct fwd_ports *fwd, const struct fwd_ports *rev,
 			const struct fwd_ports *tcp_fwd,
 			const struct fwd_ports *tcp_rev);
 void fwd_scan_ports_init(struct ctx *c);
+int fwd_nat_add(struct fwd_nat *nat, const struct fwd_nat_rule *rule);
+bool fwd_nat_lookup(const struct fwd_nat *nat, uint8_t pif, uint8_t proto,
+		    struct in6_addr *addr, in_port_t *port);
 
 #endif /* FWD_H */
@@ -46,6 +46,15 @@
 				 (uint32_t)htons(0xff00 | (proto)))
 
 
+#define IP6_GET_TCLASS(ip6h)						\
+	((uint8_t)(((ip6h)->priority << 4) | ((ip6h)->flow_lbl[0] >> 4)))
+#define IP6_SET_TCLASS(ip6h, tc)					\
+	do {								\
+		(ip6h)->priority = (tc) >> 4;				\
+		(ip6h)->flow_lbl[0] = ((tc) << 4) |			\
+				      ((ip6h)->flow_lbl[0] & 0xf);	\
+	} while (0)
+
 #define IN6_IS_PREFIX_LINKLOCAL(a, len)					\
 	((len) >= 10 && IN6_IS_ADDR_LINKLOCAL(a))
 
@@ -118,6 +118,26 @@ static void drop_caps_ep_except(uint64_t keep)
 		die("Couldn't drop capabilities: %s", strerror(errno));
 }
 
+/**
+ * isolate_has_cap() - Check if a capability is in our effective set
+ * @cap:	Capability number
+ *
+ * Return: true if we have @cap, false if we don't, or if we can't tell
+ */
+bool isolate_has_cap(unsigned cap)
+{
+	struct __user_cap_header_struct hdr = {
+		.version = CAP_VERSION,
+		.pid = 0,
+	};
+	struct __user_cap_data_struct data[CAP_WORDS];
+
+	if (cap >= CAP_WORDS * 32 || syscall(SYS_capget, &hdr, data))
+		return false;
+
+	return data[cap / 32].effective & BIT(cap % 32);
+}
+
 /**
  * clamp_caps() - Prevent any children from gaining caps
  *
@@ -7,6 +7,7 @@
 #ifndef ISOLATION_H
 #define ISOLATION_H
 
+bool isolate_has_cap(unsigned cap);
 void isolate_initial(void);
 void isolate_user(uid_t uid, gid_t gid, bool use_userns, const char *userns,
 		  enum passt_modes mode);
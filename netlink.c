@@ -26,6 +26,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
+#include <sys/epoll.h>
 
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
@@ -34,6 +35,8 @@
 #include "passt.h"
 #include "log.h"
 #include "ip.h"
+#include "siphash.h"
+#include "inany.h"
 #include "netlink.h"
 
 /* Netlink expects a buffer of at least 8kiB or the system page size,
@@ -50,6 +53,21 @@ int nl_sock	= -1;
 int nl_sock_ns	= -1;
 static int nl_seq = 1;
 
+/* Cache of local addresses in init namespace, updated by notifications */
+#define NL_ADDR_LOCAL_MAX	256
+static int nl_sock_addr = -1;
+
+/**
+ * struct nl_addr_local_entry - Cached local address
+ * @addr:	Address, IPv4-mapped for IPv4
+ * @ifi:	Interface index: the same address can be on multiple interfaces
+ */
+static struct nl_addr_local_entry {
+	union inany_addr addr;
+	unsigned int ifi;
+} nl_addr_local_cache[NL_ADDR_LOCAL_MAX];
+static int nl_addr_local_n = -1;	/* -1: not available, ask the kernel */
+
 /**
  * nl_sock_init_do() - Set up netlink sockets in init or target namespace
  * @arg:	Execution context, if running from namespace, NULL otherwise
@@ -531,7 +549,7 @@ int nl_route_dup(int s_src, unsigned int ifi_src,
 		.rta.rta_len	  = RTA_LENGTH(sizeof(unsigned int)),
 		.ifi		  = ifi_src,
 	};
-	ssize_t nlmsgs_size, left, status;
+	ssize_t nlmsgs_size, left, status, batch_len;
 	unsigned dup_routes = 0;
 	struct nlmsghdr *nh;
 	char buf[NLBUFSIZ];
@@ -602,29 +620,89 @@ int nl_route_dup(int s_src, unsigned int ifi_src,
 	if (status < 0)
 		return status;
 
+	/* Keep only routes, contiguous at the start of the buffer, so that we
+	 * can send all of them with a single send(), and adjust flags once.
+	 */
+	for (nh = (struct nlmsghdr *)buf, left = nlmsgs_size, batch_len = 0;
+	     NLMSG_OK(nh, left);) {
+		size_t len = NLMSG_ALIGN(nh->nlmsg_len);
+		uint16_t flags = nh->nlmsg_flags;
+		struct nlmsghdr *next;
+
+		/* Moving this message might overwrite its own header */
+		next = NLMSG_NEXT(nh, left);
+
+		if (nh->nlmsg_type == RTM_NEWROUTE) {
+			nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK |
+					  NLM_F_CREATE |
+					  (flags & ~NLM_F_DUMP_FILTERED);
+			nh->nlmsg_pid = 0;
+
+			memmove(buf + batch_len, nh, len);
+			batch_len += len;
+		}
+
+		nh = next;
+	}
+
 	/* Routes might have dependencies between each other, and the kernel
 	 * processes RTM_NEWROUTE messages sequentially. For n routes, we might
 	 * need to send the requests up to n times to get all of them inserted.
 	 * Routes that have been already inserted will return -EEXIST, but we
 	 * can safely ignore that and repeat the requests. This avoids the need
 	 * to calculate dependencies: let the kernel do that.
+	 *
+	 * Each pass is a single batch of requests, and we stop as soon as no
+	 * route was rejected as unreachable, so that's usually one or two
+	 * round-trips, instead of up to n * n.
 	 */
 	for (i = 0; i < dup_routes; i++) {
-		for (nh = (struct nlmsghdr *)buf, left = nlmsgs_size;
+		bool unreachable = false;
+		char ack[NLBUFSIZ];
+		uint32_t seq_first;
+		unsigned acked;
+		int rc = 0;
+		ssize_t n;
+
+		seq_first = nl_seq;
+		for (nh = (struct nlmsghdr *)buf, left = batch_len;
 		     NLMSG_OK(nh, left);
-		     nh = NLMSG_NEXT(nh, left)) {
-			uint16_t flags = nh->nlmsg_flags;
-			int rc;
-
-			if (nh->nlmsg_type != RTM_NEWROUTE)
+		     nh = NLMSG_NEXT(nh, left))
+			nh->nlmsg_seq = nl_seq++;
+
+		n = send(s_dst, buf, batch_len, 0);
+		if (n < 0)
+			die("netlink: Failed to send(): %s", strerror(errno));
+		else if (n < batch_len)
+			die("netlink: Short send (%zd of %zd bytes)",
+			    n, batch_len);
+
+		for (acked = 0, nh = NULL; acked < dup_routes; acked++) {
+			const struct nlmsgerr *errmsg;
+
+			nh = nl_next(s_dst, ack, nh, &left);
+			if (nh->nlmsg_seq != seq_first + acked)
+				die("netlink: Unexpected sequence number (%u != %u)",
+				    nh->nlmsg_seq, seq_first + acked);
+
+			if (nh->nlmsg_type != NLMSG_ERROR) {
+				warn("netlink: Unexpected response message");
 				continue;
+			}
 
-			rc = nl_do(s_dst, nh, RTM_NEWROUTE,
-				   (flags & ~NLM_F_DUMP_FILTERED) | NLM_F_CREATE,
-				   nh->nlmsg_len);
-			if (rc < 0 && rc != -ENETUNREACH && rc != -EEXIST)
-				return rc;
+			errmsg = (const struct nlmsgerr *)NLMSG_DATA(nh);
+			if (errmsg->error == -ENETUNREACH)
+				unreachable = true;
+			else if (errmsg->error < 0 && errmsg->error != -EEXIST &&
+				 !rc)
+				rc = errmsg->error;
 		}
+
+		if (rc < 0)
+			return rc;
+
+		if (!unreachable)
+			break;
 	}
 
 	return 0;
@@ -695,6 +773,201 @@ int nl_addr_get(int s, unsigned int ifi, sa_family_t af,
 	return status;
 }
 
+/**
+ * nl_addr_local_update() - Add or remove local address from cache
+ * @nh:		RTM_NEWADDR or RTM_DELADDR message, from dump or notification
+ */
+static void nl_addr_local_update(const struct nlmsghdr *nh)
+{
+	const struct ifaddrmsg *ifa = (struct ifaddrmsg *)NLMSG_DATA(nh);
+	const void *addr = NULL;
+	union inany_addr a;
+	struct rtattr *rta;
+	size_t na;
+	int i;
+
+	if (nl_addr_local_n < 0 ||
+	    (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6))
+		return;
+
+	/* IFA_LOCAL, if present, is the local address of point-to-point links,
+	 * and IFA_ADDRESS the one of the peer
+	 */
+	for (rta = IFA_RTA(ifa), na = IFA_PAYLOAD(nh); RTA_OK(rta, na);
+	     rta = RTA_NEXT(rta, na)) {
+		if (rta->rta_type == IFA_LOCAL)
+			addr = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_ADDRESS && !addr)
+			addr = RTA_DATA(rta);
+	}
+
+	if (!addr)
+		return;
+
+	inany_from_af(&a, ifa->ifa_family, addr);
+
+	for (i = 0; i < nl_addr_local_n; i++) {
+		if (nl_addr_local_cache[i].ifi == ifa->ifa_index &&
+		    inany_equals(&nl_addr_local_cache[i].addr, &a))
+			break;
+	}
+
+	if (nh->nlmsg_type == RTM_DELADDR) {
+		if (i < nl_addr_local_n)
+			nl_addr_local_cache[i] =
+				nl_addr_local_cache[--nl_addr_local_n];
+		return;
+	}
+
+	if (i < nl_addr_local_n)
+		return;
+
+	if (nl_addr_local_n == NL_ADDR_LOCAL_MAX) {
+		debug("netlink: too many local addresses, not caching them");
+		nl_addr_local_n = -1;
+		return;
+	}
+
+	nl_addr_local_cache[nl_addr_local_n].addr = a;
+	nl_addr_local_cache[nl_addr_local_n++].ifi = ifa->ifa_index;
+}
+
+/**
+ * nl_addr_local_dump() - Fill local address cache from scratch
+ */
+static void nl_addr_local_dump(void)
+{
+	struct req_t {
+		struct nlmsghdr nlh;
+		struct ifaddrmsg ifa;
+	} req = {
+		.ifa.ifa_family = AF_UNSPEC,
+	};
+	struct nlmsghdr *nh;
+	char buf[NLBUFSIZ];
+	ssize_t status;
+	uint32_t seq;
+
+	nl_addr_local_n = 0;
+
+	seq = nl_send(nl_sock, &req, RTM_GETADDR, NLM_F_DUMP, sizeof(req));
+	nl_foreach_oftype(nh, status, nl_sock, buf, seq, RTM_NEWADDR)
+		nl_addr_local_update(nh);
+
+	if (status < 0) {
+		debug("netlink: failed to dump local addresses: %s",
+		      strerror(-status));
+		nl_addr_local_n = -1;
+	}
+}
+
+/**
+ * nl_addr_local_init() - Subscribe to address changes, fill local address cache
+ * @c:		Execution context
+ *
+ * If anything fails here, nl_addr_local() just reports local addresses as
+ * unknown, and callers need to find out on their own.
+ */
+void nl_addr_local_init(const struct ctx *c)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
+	};
+	union epoll_ref ref = { .type = EPOLL_TYPE_NL_ADDR };
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	if (nl_sock < 0)
+		return;
+
+	nl_sock_addr = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK |
+			      SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl_sock_addr < 0)
+		return;
+
+	if (bind(nl_sock_addr, (struct sockaddr *)&addr, sizeof(addr)))
+		goto fail;
+
+	ref.fd = nl_sock_addr;
+	ev.data.u64 = ref.u64;
+	if (epoll_ctl(c->epollfd, EPOLL_CTL_ADD, nl_sock_addr, &ev))
+		goto fail;
+
+	/* Subscribed first: changes racing with the dump are seen twice */
+	nl_addr_local_dump();
+	if (nl_addr_local_n >= 0)
+		debug("netlink: caching %i local addresses", nl_addr_local_n);
+
+	return;
+
+fail:
+	close(nl_sock_addr);
+	nl_sock_addr = -1;
+}
+
+/**
+ * nl_addr_local_handler() - Handle address notifications, update local cache
+ */
+void nl_addr_local_handler(void)
+{
+	char buf[NLBUFSIZ];
+	struct nlmsghdr *nh;
+	ssize_t n;
+
+	while ((n = recv(nl_sock_addr, buf, sizeof(buf), 0)) != 0) {
+		if (n < 0) {
+			int rc = errno;
+
+			if (rc == ENOBUFS)	/* Lost notifications */
+				nl_addr_local_dump();
+
+			if (rc == EAGAIN || rc == EWOULDBLOCK ||
+			    rc == ENOBUFS || rc == EINTR)
+				break;
+
+			debug("netlink: can't receive address notifications");
+			nl_addr_local_n = -1;
+			break;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n);
+		     nh = NLMSG_NEXT(nh, n)) {
+			if (nh->nlmsg_type == RTM_NEWADDR ||
+			    nh->nlmsg_type == RTM_DELADDR)
+				nl_addr_local_update(nh);
+		}
+	}
+}
+
+/**
+ * nl_addr_local() - Check if address is local in init namespace, using cache
+ * @af:		Address family
+ * @addr:	Address, struct in_addr or struct in6_addr
+ *
+ * Return: 1 if the address is local, 0 if it's not, -1 if unknown
+ */
+int nl_addr_local(sa_family_t af, const void *addr)
+{
+	union inany_addr a;
+	int i;
+
+	if (nl_addr_local_n < 0)
+		return -1;
+
+	inany_from_af(&a, af, addr);
+
+	/* The whole 127.0.0.0/8 is local, but we only cache 127.0.0.1/8 */
+	if (inany_is_loopback(&a))
+		return 1;
+
+	for (i = 0; i < nl_addr_local_n; i++) {
+		if (inany_equals(&nl_addr_local_cache[i].addr, &a))
+			return 1;
+	}
+
+	return 0;
+}
+
 /**
  * nl_add_set() - Set IP addresses for given interface and address family
  * @s:		Netlink socket
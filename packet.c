@@ -27,11 +27,12 @@
  * @p:		Existing pool
  * @len:	Length of new descriptor
  * @start:	Start of data
+ * @hlen:	Length of validated header, for packet_hdr(), packet_data(), or 0
  * @func:	For tracing: name of calling function, NULL means no trace()
  * @line:	For tracing: caller line of function call
  */
 void packet_add_do(struct pool *p, size_t len, const char *start,
-		   const char *func, int line)
+		   size_t hlen, const char *func, int line)
 {
 	size_t idx = p->count;
 
@@ -59,6 +60,12 @@ void packet_add_do(struct pool *p, size_t len, const char *start,
 		return;
 	}
 
+	if (hlen > len) {
+		trace("add packet header length %zu, length %zu, %s:%i",
+		      hlen, len, func, line);
+		return;
+	}
+
 #if UINTPTR_MAX == UINT64_MAX
 	if ((uintptr_t)start - (uintptr_t)p->buf > UINT32_MAX) {
 		trace("add packet start %p, buffer start %p, %s:%i",
@@ -69,6 +76,7 @@ void packet_add_do(struct pool *p, size_t len, const char *start,
 
 	p->pkt[idx].offset = start - p->buf;
 	p->pkt[idx].len = len;
+	p->pkt[idx].hlen = hlen;
 
 	p->count++;
 }
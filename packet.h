@@ -10,10 +10,12 @@
  * struct desc - Generic offset-based descriptor within buffer
  * @offset:	Offset of descriptor relative to buffer start, 32-bit limit
  * @len:	Length of descriptor, host order, 16-bit limit
+ * @hlen:	Validated length of header (L4, with options) before payload
  */
 struct desc {
 	uint32_t offset;
 	uint16_t len;
+	uint16_t hlen;
 };
 
 /**
@@ -33,14 +35,17 @@ struct pool {
 };
 
 void packet_add_do(struct pool *p, size_t len, const char *start,
-		   const char *func, int line);
+		   size_t hlen, const char *func, int line);
 void *packet_get_do(const struct pool *p, const size_t idx,
 		    size_t offset, size_t len, size_t *left,
 		    const char *func, int line);
 void pool_flush(struct pool *p);
 
 #define packet_add(p, len, start)					\
-	packet_add_do(p, len, start, __func__, __LINE__)
+	packet_add_do(p, len, start, 0, __func__, __LINE__)
+
+#define packet_add_hdr(p, len, start, hlen)				\
+	packet_add_do(p, len, start, hlen, __func__, __LINE__)
 
 #define packet_get(p, idx, offset, len, left)				\
 	packet_get_do(p, idx, offset, len, left, __func__, __LINE__)
@@ -48,6 +53,37 @@ void pool_flush(struct pool *p);
 #define packet_get_try(p, idx, offset, len, left)			\
 	packet_get_do(p, idx, offset, len, left, NULL, 0)
 
+/**
+ * packet_hdr() - Get header of packet added with packet_add_hdr(), unchecked
+ * @p:		Packet pool
+ * @idx:	Index of packet descriptor in pool, below pool count
+ * @hlen:	Length of header, including options, set on return, can be NULL
+ *
+ * Return: pointer to start of packet, with at least @hlen bytes of header
+ */
+static inline void *packet_hdr(const struct pool *p, size_t idx, size_t *hlen)
+{
+	if (hlen)
+		*hlen = p->pkt[idx].hlen;
+
+	return p->buf + p->pkt[idx].offset;
+}
+
+/**
+ * packet_data() - Get payload of packet added with packet_add_hdr(), unchecked
+ * @p:		Packet pool
+ * @idx:	Index of packet descriptor in pool, below pool count
+ * @len:	Length of payload, set on return
+ *
+ * Return: pointer to payload, right after header
+ */
+static inline void *packet_data(const struct pool *p, size_t idx, size_t *len)
+{
+	*len = p->pkt[idx].len - p->pkt[idx].hlen;
+
+	return p->buf + p->pkt[idx].offset + p->pkt[idx].hlen;
+}
+
 #define PACKET_POOL_DECL(_name, _size, _buf)				\
 struct _name ## _t {							\
 	char *buf;							\
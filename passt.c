@@ -35,6 +35,7 @@
 #include <libgen.h>
 #include <syslog.h>
 #include <sys/prctl.h>
+#include <sys/ioctl.h>
 #include <netinet/if_ether.h>
 #ifdef HAS_GETRANDOM
 #include <sys/random.h>
@@ -52,6 +53,7 @@
 #include "arch.h"
 #include "log.h"
 #include "tcp_splice.h"
+#include "netlink.h"
 
 #define EPOLL_EVENTS		8
 
@@ -59,6 +61,8 @@
 #define TIMER_INTERVAL_		MIN(TIMER_INTERVAL__, ICMP_TIMER_INTERVAL)
 #define TIMER_INTERVAL		MIN(TIMER_INTERVAL_, FLOW_TIMER_INTERVAL)
 
+#define BUSY_POLL_REPORT	10000	/* ms, interval for CPU usage report */
+
 char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
 
 char *epoll_type_str[] = {
@@ -73,12 +77,13 @@ char *epoll_type_str[] = {
 	[EPOLL_TYPE_TAP_PASTA]		= "/dev/net/tun device",
 	[EPOLL_TYPE_TAP_PASST]		= "connected qemu socket",
 	[EPOLL_TYPE_TAP_LISTEN]		= "listening qemu socket",
+	[EPOLL_TYPE_NL_ADDR]		= "netlink address notifications",
 };
 static_assert(ARRAY_SIZE(epoll_type_str) == EPOLL_NUM_TYPES,
 	      "epoll_type_str[] doesn't match enum epoll_type");
 
 /**
- * post_handler() - Run periodic and deferred tasks for L4 protocol handlers
+ * post_handler() - Run periodic and deferred tasks, send out frames to tap
  * @c:		Execution context
  * @now:	Current timestamp
  */
@@ -107,8 +112,16 @@ static void post_handler(struct ctx *c, const struct timespec *now)
 	/* NOLINTNEXTLINE(bugprone-branch-clone): intervals can be the same */
 	CALL_PROTO_HANDLER(c, now, udp, UDP);
 
+	/* Queued data frames point to sequences in the flow table: send them
+	 * out before flows are freed
+	 */
+	tap_flush(c);
+
 	flow_defer_handler(c, now);
 #undef CALL_PROTO_HANDLER
+
+	/* Frames queued while closing flows, with no sequence to update */
+	tap_flush(c);
 }
 
 /**
@@ -156,6 +169,106 @@ static void timer_init(struct ctx *c, const struct timespec *now)
 	c->tcp.timer_run = c->udp.timer_run = c->icmp.timer_run = *now;
 }
 
+/**
+ * startup_phase() - Report time spent in startup phase, in debug mode
+ * @phase:	Description of completed phase, NULL to just start counting
+ */
+static void startup_phase(const char *phase)
+{
+	static struct timespec last;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (phase)
+		debug("Startup: %s took %lli us",
+		      phase, timespec_diff_us(&now, &last));
+	last = now;
+}
+
+/**
+ * affinity_init() - Pin to configured CPUs, pre-fault packet buffer from there
+ * @c:		Execution context
+ *
+ * With the default memory policy, pages are allocated on the memory node of
+ * the CPU first touching them: from here on, it's one of the configured ones.
+ *
+ * #syscalls sched_setaffinity
+ */
+static void affinity_init(const struct ctx *c)
+{
+	if (!CPU_COUNT(&c->cpus))
+		return;
+
+	if (sched_setaffinity(0, sizeof(c->cpus), &c->cpus))
+		die("Failed to set CPU affinity: %s", strerror(errno));
+
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(pkt_buf, sizeof(pkt_buf), MADV_POPULATE_WRITE))
+		return;
+#endif
+	memset(pkt_buf, 0, sizeof(pkt_buf));
+}
+
+/**
+ * busy_poll_init() - Set up busy polling parameters for epoll instance
+ * @c:		Execution context
+ *
+ * #syscalls ioctl
+ */
+static void busy_poll_init(const struct ctx *c)
+{
+#ifdef EPIOCSPARAMS
+	struct epoll_params p = {
+		.busy_poll_usecs = c->busy_poll,
+		.busy_poll_budget = EPOLL_EVENTS,
+		.prefer_busy_poll = 1,
+	};
+
+	if (c->busy_poll && ioctl(c->epollfd, EPIOCSPARAMS, &p))
+		debug("Can't set epoll busy poll parameters: %s",
+		      strerror(errno));
+#else
+	(void)c;
+#endif
+}
+
+/**
+ * busy_poll_report() - Periodically report CPU usage with busy polling
+ * @now:	Current timestamp
+ * @events:	Number of events in this loop iteration
+ */
+static void busy_poll_report(const struct timespec *now, int events)
+{
+	static unsigned long spins, idle_spins;
+	static struct timespec last;
+	static long long last_cpu;
+	struct rusage ru;
+	long long cpu;
+	int elapsed;
+
+	spins++;
+	if (!events)
+		idle_spins++;
+
+	if ((elapsed = timespec_diff_ms(now, &last)) < BUSY_POLL_REPORT)
+		return;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return;
+
+	cpu = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+	      ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+
+	if (last.tv_sec) {
+		debug("Busy poll: %lli%% CPU, %lu loop iterations, %lu idle",
+		      (cpu - last_cpu) / 10 / elapsed, spins, idle_spins);
+	}
+
+	spins = idle_spins = 0;
+	last_cpu = cpu;
+	last = *now;
+}
+
 /**
  * proto_update_l2_buf() - Update scatter-gather L2 buffers in protocol handlers
  * @eth_d:	Ethernet destination address, NULL if unchanged
@@ -200,8 +313,9 @@ void exit_handler(int signal)
  */
 int main(int argc, char **argv)
 {
-	int nfds, i, devnull_fd = -1, pidfile_fd = -1;
+	int nfds, i, devnull_fd = -1, pidfile_fd = -1, timeout, pace;
 	struct epoll_event events[EPOLL_EVENTS];
+	struct timespec last_activity = { 0 };
 	char *log_name, argv0[PATH_MAX], *name;
 	struct ctx c = { 0 };
 	struct rlimit limit;
@@ -210,9 +324,12 @@ int main(int argc, char **argv)
 
 	arch_avx2_exec(argv);
 
+	startup_phase(NULL);
+
 	// isolate_initial();
 
 	c.pasta_netns_fd = c.fd_tap = c.fd_tap_listen = -1;
+	memset(c.fd_tap_queues, 0xff, sizeof(c.fd_tap_queues));
 
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = 0;
@@ -269,10 +386,13 @@ int main(int argc, char **argv)
 
 	conf(&c, argc, argv);
 	trace_init(c.trace);
+	affinity_init(&c);
+	startup_phase("configuration and namespace setup");
 
 	pasta_netns_quit_init(&c);
 
 	tap_sock_init(&c);
+	startup_phase("tap interface setup");
 
 	secret_init(&c);
 
@@ -282,6 +402,7 @@ int main(int argc, char **argv)
 
 	if ((!c.no_udp && udp_init(&c)) || (!c.no_tcp && tcp_init(&c)))
 		exit(EXIT_FAILURE);
+	startup_phase("flow table and port forwarding setup");
 
 	proto_update_l2_buf(c.mac_guest, c.mac);
 
@@ -322,15 +443,35 @@ int main(int argc, char **argv)
 
 	if (pasta_child_pid)
 		kill(pasta_child_pid, SIGUSR1);
+	startup_phase("logging and daemon setup");
 
 	// isolate_postfork(&c);
 
+	ns_helper_init(&c);
+
+	busy_poll_init(&c);
+
+	if (!c.no_tcp)
+		tcp_warm_up(&c);
+	startup_phase("namespace helper and pool warm-up");
+
 	timer_init(&c, &now);
 
 loop:
+	timeout = TIMER_INTERVAL;
+
+	/* Wake up as soon as datagrams held back by --rate-limit can be sent */
+	if (c.tap_rate.rate && (pace = udp_pace_timeout(&c)) >= 0 &&
+	    pace < timeout)
+		timeout = pace;
+
+	/* With busy polling, don't sleep for a while after some activity */
+	if (c.busy_poll && timespec_diff_us(&now, &last_activity) < c.busy_poll)
+		timeout = 0;
+
 	/* NOLINTNEXTLINE(bugprone-branch-clone): intervals can be the same */
 	/* cppcheck-suppress [duplicateValueTernary, unmatchedSuppression] */
-	nfds = epoll_wait(c.epollfd, events, EPOLL_EVENTS, TIMER_INTERVAL);
+	nfds = epoll_wait(c.epollfd, events, EPOLL_EVENTS, timeout);
 	if (nfds == -1 && errno != EINTR) {
 		perror("epoll_wait");
 		exit(EXIT_FAILURE);
@@ -338,6 +479,19 @@ loop:
 
 	clock_gettime(CLOCK_MONOTONIC, &now);
 
+	if (c.tap_rate.rate) {
+		rate_refill(&c.tap_rate, &now);
+		udp_pace_flush(&c);
+	}
+
+	if (c.busy_poll) {
+		if (nfds > 0)
+			last_activity = now;
+
+		if (c.debug)
+			busy_poll_report(&now, nfds);
+	}
+
 	for (i = 0; i < nfds; i++) {
 		union epoll_ref ref = *((union epoll_ref *)&events[i].data.u64);
 		uint32_t eventmask = events[i].events;
@@ -348,7 +502,7 @@ loop:
 
 		switch (ref.type) {
 		case EPOLL_TYPE_TAP_PASTA:
-			tap_handler_pasta(&c, eventmask, &now);
+			tap_handler_pasta(&c, ref.fd, eventmask, &now);
 			break;
 		case EPOLL_TYPE_TAP_PASST:
 			tap_handler_passt(&c, eventmask, &now);
@@ -380,6 +534,9 @@ loop:
 		case EPOLL_TYPE_PING:
 			icmp_sock_handler(&c, ref);
 			break;
+		case EPOLL_TYPE_NL_ADDR:
+			nl_addr_local_handler();
+			break;
 		default:
 			/* Can't happen */
 			ASSERT(0);
@@ -71,6 +71,8 @@ enum epoll_type {
 	EPOLL_TYPE_TAP_PASST,
 	/* socket listening for qemu socket connections */
 	EPOLL_TYPE_TAP_LISTEN,
+	/* netlink socket for address change notifications */
+	EPOLL_TYPE_NL_ADDR,
 
 	EPOLL_NUM_TYPES,
 };
@@ -147,6 +149,8 @@ enum passt_modes {
 	MODE_PASTA,
 };
 
+#define OUT_POOL_MAX		16
+
 /**
  * struct ip4_ctx - IPv4 execution context
  * @addr:		IPv4 address for external, routable interface
@@ -158,6 +162,9 @@ enum passt_modes {
  * @dns_host:		Use this DNS on the host for forwarding, network order
  * @addr_out:		Optional source address for outbound traffic
  * @ifname_out:		Optional interface name to bind outbound sockets to
+ * @pool_out:		Pool of source addresses for outbound TCP connections
+ * @pool_ifname_out:	Interface to bind to for each pool address, optional
+ * @pool_out_n:		Number of addresses in @pool_out
  */
 struct ip4_ctx {
 	struct in_addr addr;
@@ -170,6 +177,10 @@ struct ip4_ctx {
 
 	struct in_addr addr_out;
 	char ifname_out[IFNAMSIZ];
+
+	struct in_addr pool_out[OUT_POOL_MAX];
+	char pool_ifname_out[OUT_POOL_MAX][IFNAMSIZ];
+	int pool_out_n;
 };
 
 /**
@@ -184,6 +195,9 @@ struct ip4_ctx {
  * @dns_host:		Use this DNS on the host for forwarding
  * @addr_out:		Optional source address for outbound traffic
  * @ifname_out:		Optional interface name to bind outbound sockets to
+ * @pool_out:		Pool of source addresses for outbound TCP connections
+ * @pool_ifname_out:	Interface to bind to for each pool address, optional
+ * @pool_out_n:		Number of addresses in @pool_out
  */
 struct ip6_ctx {
 	struct in6_addr addr;
@@ -197,9 +211,17 @@ struct ip6_ctx {
 
 	struct in6_addr addr_out;
 	char ifname_out[IFNAMSIZ];
+
+	struct in6_addr pool_out[OUT_POOL_MAX];
+	char pool_ifname_out[OUT_POOL_MAX][IFNAMSIZ];
+	int pool_out_n;
 };
 
 #include <netinet/if_ether.h>
+#include <sched.h>
+
+#define TAP_QUEUES_MAX		8
+#define BUSY_POLL_MAX		1000000		/* us */
 
 /**
  * struct ctx - Execution context
@@ -211,6 +233,7 @@ struct ip6_ctx {
  * @force_stderr:	Force logging to stderr
  * @nofile:		Maximum number of open files (ulimit -n)
  * @sock_path:		Path for UNIX domain socket
+ * @sock_type:		AF_UNIX socket type: SOCK_STREAM, SOCK_SEQPACKET, SOCK_DGRAM
  * @pcap:		Path for packet capture file
  * @pid_file:		Path to PID file, empty string if not configured
  * @pasta_netns_fd:	File descriptor for network namespace in pasta mode
@@ -220,6 +243,8 @@ struct ip6_ctx {
  * @epollfd:		File descriptor for epoll instance
  * @fd_tap_listen:	File descriptor for listening AF_UNIX socket, if any
  * @fd_tap:		AF_UNIX socket, tuntap device, or pre-opened socket
+ * @fd_tap_queues:	Additional queues of multi-queue tuntap device, -1 if unused
+ * @tap_queues:		Number of tuntap device queues in pasta mode
  * @mac:		Host MAC address
  * @mac_guest:		MAC address of guest or namespace, seen or configured
  * @hash_secret:	128-bit secret for siphash functions
@@ -249,8 +274,12 @@ struct ip6_ctx {
  * @no_ndp:		Disable NDP handler altogether
  * @no_ra:		Disable router advertisements
  * @no_map_gw:		Don't map connections, untracked UDP to gateway to host
+ * @nat:		Address and port translation rules for new flows
+ * @tap_rate:		Token bucket limiting data from guest, rate 0 if unlimited
  * @low_wmem:		Low probed net.core.wmem_max
  * @low_rmem:		Low probed net.core.rmem_max
+ * @busy_poll:		Keep polling for this long after activity, microseconds
+ * @cpus:		CPUs to run on, and to place buffers close to, if any
  */
 struct ctx {
 	enum passt_modes mode;
@@ -261,6 +290,7 @@ struct ctx {
 	int force_stderr;
 	int nofile;
 	char sock_path[UNIX_PATH_MAX];
+	int sock_type;
 	char pcap[PATH_MAX];
 	char pid_file[PATH_MAX];
 	int one_off;
@@ -274,6 +304,8 @@ struct ctx {
 	int epollfd;
 	int fd_tap_listen;
 	int fd_tap;
+	int fd_tap_queues[TAP_QUEUES_MAX - 1];
+	int tap_queues;
 	unsigned char mac[ETH_ALEN];
 	unsigned char mac_guest[ETH_ALEN];
 	uint64_t hash_secret[2];
@@ -309,9 +341,14 @@ struct ctx {
 	int no_ndp;
 	int no_ra;
 	int no_map_gw;
+	struct fwd_nat nat;
+	struct rate_bucket tap_rate;
 
 	int low_wmem;
 	int low_rmem;
+
+	int busy_poll;
+	cpu_set_t cpus;
 };
 
 void proto_update_l2_buf(const unsigned char *eth_d,
@@ -64,32 +64,53 @@ static PACKET_POOL_NOINIT(pool_tap4, TAP_MSGS, pkt_buf);
 static PACKET_POOL_NOINIT(pool_tap6, TAP_MSGS, pkt_buf);
 
 #define TAP_SEQS		128 /* Different L4 tuples in one batch */
+#define TAP_SEQS_HASH_BITS	8   /* Buckets for lookup of sequences by tuple */
+#define TAP_SEQS_HASH		(1 << TAP_SEQS_HASH_BITS)
 #define FRAGMENT_MSG_RATE	10  /* # seconds between fragment warnings */
 
-/**
- * tap_send_single() - Send a single frame
- * @c:		Execution context
- * @data:	Packet buffer
- * @len:	Total L2 packet length
+/* Mode-specific send path, and length of frame header (if any) before L2
+ * frame, selected once at start-up by tap_sock_init()
  */
-void tap_send_single(const struct ctx *c, const void *data, size_t len)
-{
-	uint32_t vnet_len = htonl(len);
-	struct iovec iov[2];
-	size_t iovcnt = 0;
+static size_t (*tap_send_frames_mode)(const struct ctx *c,
+				      const struct iovec *iov,
+				      size_t bufs_per_frame, size_t nframes);
+static size_t tap_hdr_len;
 
-	if (c->mode == MODE_PASST) {
-		iov[iovcnt].iov_base = &vnet_len;
-		iov[iovcnt].iov_len = sizeof(vnet_len);
-		iovcnt++;
-	}
+/* Frames to and from message-based (SOCK_SEQPACKET, SOCK_DGRAM) transports:
+ * one frame per message, each received into its own slot of pkt_buf
+ */
+static struct mmsghdr tap_mmh_recv[UIO_MAXIOV];
+static struct iovec tap_iov_recv[UIO_MAXIOV];
+static struct mmsghdr tap_mmh_send[UIO_MAXIOV];
+static unsigned int tap_msg_count;	/* Slots, frames per recvmmsg() */
+static size_t tap_msg_slot;		/* Slot size, maximum frame length */
+
+/* SOCK_DGRAM: source of the first frame in a batch, and last peer address */
+static struct sockaddr_un tap_dgram_src;
+static struct sockaddr_un tap_dgram_peer;
+static socklen_t tap_dgram_peer_len;
+
+/* Output queue shared by all handlers, flushed by tap_flush(): frames are sent
+ * in the order they're queued, in a single batch if possible
+ */
+#define TAP_OUT_FRAMES		UIO_MAXIOV
+#define TAP_SINGLE_BYTES	(1 << 18)	/* Copies of tap_send_single() */
 
-	iov[iovcnt].iov_base = (void *)data;
-	iov[iovcnt].iov_len = len;
-	iovcnt++;
+/**
+ * struct tap_out_seq - Sequence to advance once a queued frame is sent
+ * @seq:	Pointer to sequence number, NULL if none
+ * @len:	Amount to advance sequence by
+ */
+static struct tap_out_seq {
+	uint32_t *seq;
+	uint32_t len;
+} tap_out_seq[TAP_OUT_FRAMES];
 
-	tap_send_frames(c, iov, iovcnt, 1);
-}
+static struct iovec tap_out_iov[TAP_OUT_FRAMES];
+static unsigned int tap_out_count;
+
+static char tap_single_buf[TAP_SINGLE_BYTES];
+static size_t tap_single_used;
 
 /**
  * tap_ip4_daddr() - Normal IPv4 destination address for inbound packets
@@ -159,7 +180,7 @@ static void *tap_push_ip4h(struct iphdr *ip4h, struct in_addr src,
 	ip4h->protocol = proto;
 	ip4h->saddr = src.s_addr;
 	ip4h->daddr = dst.s_addr;
-	ip4h->check = csum_ip4_header(ip4h->tot_len, proto, src, dst);
+	ip4h->check = csum_ip4_header(ip4h->tot_len, 0, proto, src, dst);
 	return ip4h + 1;
 }
 
@@ -395,6 +416,60 @@ static size_t tap_send_frames_passt(const struct ctx *c,
 	return i / bufs_per_frame;
 }
 
+/**
+ * tap_send_frames_msg() - Send multiple frames, one per message, to passt tap
+ * @c:			Execution context
+ * @iov:		Array of buffers, each containing one frame
+ * @bufs_per_frame:	Number of buffers (iovec entries) per frame
+ * @nframes:		Number of frames to send
+ *
+ * @iov must have total length @bufs_per_frame * @nframes, with each set of
+ * @bufs_per_frame contiguous buffers representing a single frame.
+ *
+ * Return: number of frames successfully sent
+ *
+ * #syscalls:passt sendmmsg
+ */
+static size_t tap_send_frames_msg(const struct ctx *c,
+				  const struct iovec *iov,
+				  size_t bufs_per_frame, size_t nframes)
+{
+	size_t i, sent = 0;
+
+	while (sent < nframes) {
+		size_t n = MIN(nframes - sent, ARRAY_SIZE(tap_mmh_send));
+		int ret;
+
+		for (i = 0; i < n; i++) {
+			struct msghdr *mh = &tap_mmh_send[i].msg_hdr;
+
+			mh->msg_iov = (struct iovec *)iov +
+				      (sent + i) * bufs_per_frame;
+			mh->msg_iovlen = bufs_per_frame;
+
+			/* Unconnected SOCK_DGRAM: reply to the last source */
+			if (tap_dgram_peer_len) {
+				mh->msg_name = &tap_dgram_peer;
+				mh->msg_namelen = tap_dgram_peer_len;
+			}
+		}
+
+		ret = sendmmsg(c->fd_tap, tap_mmh_send, n,
+			       MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret <= 0) {
+			if (ret < 0)
+				debug("tap send: %s", strerror(errno));
+			break;
+		}
+
+		sent += ret;
+		if ((size_t)ret < n)
+			break;
+	}
+
+	return sent;
+}
+
 /**
  * tap_send_frames() - Send out multiple prepared frames
  * @c:			Execution context
@@ -407,29 +482,101 @@ static size_t tap_send_frames_passt(const struct ctx *c,
  *
  * Return: number of frames actually sent
  */
-size_t tap_send_frames(const struct ctx *c, const struct iovec *iov,
-		       size_t bufs_per_frame, size_t nframes)
+static size_t tap_send_frames(const struct ctx *c, const struct iovec *iov,
+			      size_t bufs_per_frame, size_t nframes)
 {
 	size_t m;
 
 	if (!nframes)
 		return 0;
 
-	if (c->mode == MODE_PASST)
-		m = tap_send_frames_passt(c, iov, bufs_per_frame, nframes);
-	else
-		m = tap_send_frames_pasta(c, iov, bufs_per_frame, nframes);
+	m = tap_send_frames_mode(c, iov, bufs_per_frame, nframes);
 
 	if (m < nframes)
 		debug("tap: failed to send %zu frames of %zu",
 		      nframes - m, nframes);
 
-	pcap_multiple(iov, bufs_per_frame, m,
-		      c->mode == MODE_PASST ? sizeof(uint32_t) : 0);
+	pcap_multiple(iov, bufs_per_frame, m, tap_hdr_len);
 
 	return m;
 }
 
+/**
+ * tap_flush() - Send out all queued frames, in order
+ * @c:		Execution context
+ *
+ * Buffers of queued frames can be reused by their owners once this returns.
+ */
+void tap_flush(const struct ctx *c)
+{
+	size_t i, m;
+
+	if (!tap_out_count)
+		return;
+
+	m = tap_send_frames(c, tap_out_iov, 1, tap_out_count);
+	for (i = 0; i < m; i++) {
+		if (tap_out_seq[i].seq)
+			*tap_out_seq[i].seq += tap_out_seq[i].len;
+	}
+
+	tap_out_count = 0;
+	tap_single_used = 0;
+}
+
+/**
+ * tap_queue() - Queue a complete frame to be sent by tap_flush()
+ * @c:		Execution context
+ * @iov:	Buffer with frame, including tap specific header, if any
+ * @seq:	Sequence number to advance by @len once the frame is sent, or NULL
+ * @len:	Amount to advance @seq by
+ *
+ * The buffer needs to stay valid, and unchanged, until tap_flush() is called.
+ * So does @seq: owners of queued frames must flush before freeing it.
+ */
+void tap_queue(const struct ctx *c, const struct iovec *iov,
+	       uint32_t *seq, uint32_t len)
+{
+	if (tap_out_count == TAP_OUT_FRAMES)
+		tap_flush(c);
+
+	tap_out_iov[tap_out_count] = *iov;
+	tap_out_seq[tap_out_count].seq = seq;
+	tap_out_seq[tap_out_count].len = len;
+	tap_out_count++;
+}
+
+/**
+ * tap_send_single() - Queue a copy of a single frame
+ * @c:		Execution context
+ * @data:	Packet buffer
+ * @len:	Total L2 packet length
+ */
+void tap_send_single(const struct ctx *c, const void *data, size_t len)
+{
+	size_t hlen = tap_has_vnet_len(c) ? sizeof(uint32_t) : 0;
+	struct iovec iov;
+	char *p;
+
+	if (tap_out_count == TAP_OUT_FRAMES ||
+	    tap_single_used + hlen + len > sizeof(tap_single_buf))
+		tap_flush(c);
+
+	p = tap_single_buf + tap_single_used;
+	if (hlen) {
+		uint32_t vnet_len = htonl(len);
+
+		memcpy(p, &vnet_len, hlen);
+	}
+	memcpy(p + hlen, data, len);
+
+	iov.iov_base = p;
+	iov.iov_len = hlen + len;
+	tap_single_used += ROUND_UP(hlen + len, sizeof(uint32_t));
+
+	tap_queue(c, &iov, NULL, 0);
+}
+
 /**
  * eth_update_mac() - Update tap L2 header with new Ethernet addresses
  * @eh:		Ethernet headers to update
@@ -453,12 +600,14 @@ PACKET_POOL_DECL(pool_l4, UIO_MAXIOV, pkt_buf);
  * @protocol:	Protocol number
  * @source:	Source port
  * @dest:	Destination port
+ * @tos:	Type of Service, same for all messages
  * @saddr:	Source address
  * @daddr:	Destination address
  * @msg:	Array of messages that can be handled in a single call
  */
 static struct tap4_l4_t {
 	uint8_t protocol;
+	uint8_t tos;
 
 	uint16_t source;
 	uint16_t dest;
@@ -475,12 +624,14 @@ static struct tap4_l4_t {
  * @protocol:	Protocol number
  * @source:	Source port
  * @dest:	Destination port
+ * @tclass:	Traffic Class, same for all messages
  * @saddr:	Source address
  * @daddr:	Destination address
  * @msg:	Array of messages that can be handled in a single call
  */
 static struct tap6_l4_t {
 	uint8_t protocol;
+	uint8_t tclass;
 
 	uint16_t source;
 	uint16_t dest;
@@ -491,6 +642,34 @@ static struct tap6_l4_t {
 	struct pool_l4_t p;
 } tap6_l4[TAP_SEQS /* Arbitrary: TAP_MSGS in theory, so limit in users */];
 
+/* Open-addressing hash table of sequences in tap[46]_l4 for the current batch:
+ * index plus one of the latest sequence for a given L4 tuple, 0 if unused
+ */
+static uint8_t tap_seq_hash[TAP_SEQS_HASH];
+
+static_assert(TAP_SEQS < UINT8_MAX && TAP_SEQS <= TAP_SEQS_HASH / 2,
+	      "Sequence hash table too small for TAP_SEQS");
+
+/**
+ * tap_seq_bucket() - Starting bucket in sequence hash table for given L4 tuple
+ * @addrs:	Source and destination addresses, folded to 32 bits
+ * @source:	Source port, network order
+ * @dest:	Destination port, network order
+ * @proto:	Protocol number
+ *
+ * The table only lives for one batch of frames, and the number of sequences is
+ * bounded, so a multiplicative hash is enough here: no need for a keyed one.
+ *
+ * Return: bucket index
+ */
+static unsigned int tap_seq_bucket(uint32_t addrs, uint16_t source,
+				   uint16_t dest, uint8_t proto)
+{
+	uint32_t h = addrs ^ ((uint32_t)source << 16 | dest) ^ proto;
+
+	return (h * 0x9e3779b1U) >> (32 - TAP_SEQS_HASH_BITS);
+}
+
 /**
  * tap_packet_debug() - Print debug message for packet(s) from guest/tap
  * @iph:	IPv4 header, can be NULL
@@ -569,6 +748,31 @@ static bool tap4_is_fragment(const struct iphdr *iph,
 	return false;
 }
 
+/**
+ * tap_l4_hlen() - Validate header of TCP segment or UDP datagram from tap
+ * @proto:	Protocol number, IPPROTO_TCP or IPPROTO_UDP
+ * @l4h:	L4 header, with @l4_len bytes available
+ * @l4_len:	L4 length, from L3 header
+ *
+ * Return: length of L4 header including options, 0 if invalid
+ */
+static size_t tap_l4_hlen(uint8_t proto, const char *l4h, size_t l4_len)
+{
+	size_t hlen;
+
+	if (proto == IPPROTO_UDP)
+		return l4_len >= sizeof(struct udphdr) ? sizeof(struct udphdr) : 0;
+
+	if (l4_len < sizeof(struct tcphdr))
+		return 0;
+
+	hlen = ((const struct tcphdr *)l4h)->doff * 4UL;
+	if (hlen < sizeof(struct tcphdr) || hlen > l4_len)
+		return 0;
+
+	return hlen;
+}
+
 /**
  * tap4_handler() - IPv4 and ARP packet handler for tap file descriptor
  * @c:		Execution context
@@ -580,7 +784,7 @@ static bool tap4_is_fragment(const struct iphdr *iph,
 static int tap4_handler(struct ctx *c, const struct pool *in,
 			const struct timespec *now)
 {
-	unsigned int i, j, seq_count;
+	unsigned int i, j, b, seq_count;
 	struct tap4_l4_t *seq;
 
 	if (!c->ifi4 || !in->count)
@@ -588,8 +792,9 @@ static int tap4_handler(struct ctx *c, const struct pool *in,
 
 	i = 0;
 resume:
+	memset(tap_seq_hash, 0, sizeof(tap_seq_hash));
 	for (seq_count = 0, seq = NULL; i < in->count; i++) {
-		size_t l2_len, l3_len, hlen, l4_len;
+		size_t l2_len, l3_len, hlen, l4_len, l4_hlen;
 		const struct ethhdr *eh;
 		const struct udphdr *uh;
 		struct iphdr *iph;
@@ -673,14 +878,21 @@ resume:
 			continue;
 		}
 
-#define L4_MATCH(iph, uh, seq)						\
+		if (!(l4_hlen = tap_l4_hlen(iph->protocol, l4h, l4_len)))
+			continue;
+
+#define L4_FLOW(iph, uh, seq)						\
 	(seq->protocol == iph->protocol &&				\
 	 seq->source   == uh->source    && seq->dest  == uh->dest &&	\
 	 seq->saddr.s_addr == iph->saddr && seq->daddr.s_addr == iph->daddr)
 
+#define L4_MATCH(iph, uh, seq)						\
+	(L4_FLOW(iph, uh, seq) && seq->tos == iph->tos)
+
 #define L4_SET(iph, uh, seq)						\
 	do {								\
 		seq->protocol		= iph->protocol;		\
+		seq->tos		= iph->tos;			\
 		seq->source		= uh->source;			\
 		seq->dest		= uh->dest;			\
 		seq->saddr.s_addr	= iph->saddr;			\
@@ -693,25 +905,32 @@ resume:
 		if (seq_count == TAP_SEQS)
 			break;	/* Resume after flushing if i < in->count */
 
-		for (seq = tap4_l4 + seq_count - 1; seq >= tap4_l4; seq--) {
-			if (L4_MATCH(iph, uh, seq)) {
-				if (seq->p.count >= UIO_MAXIOV)
-					seq = NULL;
+		b = tap_seq_bucket(iph->saddr ^ iph->daddr,
+				   uh->source, uh->dest, iph->protocol);
+		/* Find the latest sequence for this flow, whatever its TOS: if
+		 * that changed, start a new one, so that we don't reorder frames
+		 */
+		for (seq = NULL; tap_seq_hash[b]; b = (b + 1) % TAP_SEQS_HASH) {
+			seq = tap4_l4 + tap_seq_hash[b] - 1;
+			if (L4_FLOW(iph, uh, seq))
 				break;
-			}
+			seq = NULL;
 		}
 
-		if (!seq || seq < tap4_l4) {
+		if (!seq || !L4_MATCH(iph, uh, seq) ||
+		    seq->p.count >= UIO_MAXIOV) {
 			seq = tap4_l4 + seq_count++;
 			L4_SET(iph, uh, seq);
 			pool_flush((struct pool *)&seq->p);
+			tap_seq_hash[b] = seq_count;
 		}
 
+#undef L4_FLOW
 #undef L4_MATCH
 #undef L4_SET
 
 append:
-		packet_add((struct pool *)&seq->p, l4_len, l4h);
+		packet_add_hdr((struct pool *)&seq->p, l4_len, l4h, l4_hlen);
 	}
 
 	for (j = 0, seq = tap4_l4; j < seq_count; j++, seq++) {
@@ -726,14 +945,14 @@ append:
 			for (k = 0; k < p->count; )
 				k += tcp_tap_handler(c, PIF_TAP, AF_INET,
 						     &seq->saddr, &seq->daddr,
-						     p, k, now);
+						     seq->tos, p, k, now);
 		} else if (seq->protocol == IPPROTO_UDP) {
 			if (c->no_udp)
 				continue;
 			for (k = 0; k < p->count; )
 				k += udp_tap_handler(c, PIF_TAP, AF_INET,
 						     &seq->saddr, &seq->daddr,
-						     p, k, now);
+						     seq->tos, p, k, now);
 		}
 	}
 
@@ -754,7 +973,7 @@ append:
 static int tap6_handler(struct ctx *c, const struct pool *in,
 			const struct timespec *now)
 {
-	unsigned int i, j, seq_count = 0;
+	unsigned int i, j, b, seq_count = 0;
 	struct tap6_l4_t *seq;
 
 	if (!c->ifi6 || !in->count)
@@ -762,8 +981,9 @@ static int tap6_handler(struct ctx *c, const struct pool *in,
 
 	i = 0;
 resume:
+	memset(tap_seq_hash, 0, sizeof(tap_seq_hash));
 	for (seq_count = 0, seq = NULL; i < in->count; i++) {
-		size_t l4_len, plen, check;
+		size_t l4_len, l4_hlen, plen, check;
 		struct in6_addr *saddr, *daddr;
 		const struct ethhdr *eh;
 		const struct udphdr *uh;
@@ -846,15 +1066,22 @@ resume:
 			continue;
 		}
 
-#define L4_MATCH(ip6h, proto, uh, seq)					\
+		if (!(l4_hlen = tap_l4_hlen(proto, l4h, l4_len)))
+			continue;
+
+#define L4_FLOW(ip6h, proto, uh, seq)					\
 	(seq->protocol == proto         &&				\
 	 seq->source   == uh->source    && seq->dest  == uh->dest &&	\
 	 IN6_ARE_ADDR_EQUAL(&seq->saddr, saddr)			  &&	\
 	 IN6_ARE_ADDR_EQUAL(&seq->daddr, daddr))
 
+#define L4_MATCH(ip6h, proto, uh, seq)					\
+	(L4_FLOW(ip6h, proto, uh, seq) && seq->tclass == IP6_GET_TCLASS(ip6h))
+
 #define L4_SET(ip6h, proto, uh, seq)					\
 	do {								\
 		seq->protocol	= proto;				\
+		seq->tclass	= IP6_GET_TCLASS(ip6h);			\
 		seq->source	= uh->source;				\
 		seq->dest	= uh->dest;				\
 		seq->saddr	= *saddr;				\
@@ -868,25 +1095,33 @@ resume:
 		if (seq_count == TAP_SEQS)
 			break;	/* Resume after flushing if i < in->count */
 
-		for (seq = tap6_l4 + seq_count - 1; seq >= tap6_l4; seq--) {
-			if (L4_MATCH(ip6h, proto, uh, seq)) {
-				if (seq->p.count >= UIO_MAXIOV)
-					seq = NULL;
+		b = tap_seq_bucket(saddr->s6_addr32[0] ^ saddr->s6_addr32[1] ^
+				   saddr->s6_addr32[2] ^ saddr->s6_addr32[3] ^
+				   daddr->s6_addr32[0] ^ daddr->s6_addr32[1] ^
+				   daddr->s6_addr32[2] ^ daddr->s6_addr32[3],
+				   uh->source, uh->dest, proto);
+		/* Latest sequence for this flow, as for IPv4 */
+		for (seq = NULL; tap_seq_hash[b]; b = (b + 1) % TAP_SEQS_HASH) {
+			seq = tap6_l4 + tap_seq_hash[b] - 1;
+			if (L4_FLOW(ip6h, proto, uh, seq))
 				break;
-			}
+			seq = NULL;
 		}
 
-		if (!seq || seq < tap6_l4) {
+		if (!seq || !L4_MATCH(ip6h, proto, uh, seq) ||
+		    seq->p.count >= UIO_MAXIOV) {
 			seq = tap6_l4 + seq_count++;
 			L4_SET(ip6h, proto, uh, seq);
 			pool_flush((struct pool *)&seq->p);
+			tap_seq_hash[b] = seq_count;
 		}
 
+#undef L4_FLOW
 #undef L4_MATCH
 #undef L4_SET
 
 append:
-		packet_add((struct pool *)&seq->p, l4_len, l4h);
+		packet_add_hdr((struct pool *)&seq->p, l4_len, l4h, l4_hlen);
 	}
 
 	for (j = 0, seq = tap6_l4; j < seq_count; j++, seq++) {
@@ -902,14 +1137,14 @@ append:
 			for (k = 0; k < p->count; )
 				k += tcp_tap_handler(c, PIF_TAP, AF_INET6,
 						     &seq->saddr, &seq->daddr,
-						     p, k, now);
+						     seq->tclass, p, k, now);
 		} else if (seq->protocol == IPPROTO_UDP) {
 			if (c->no_udp)
 				continue;
 			for (k = 0; k < p->count; )
 				k += udp_tap_handler(c, PIF_TAP, AF_INET6,
 						     &seq->saddr, &seq->daddr,
-						     p, k, now);
+						     seq->tclass, p, k, now);
 		}
 	}
 
@@ -919,6 +1154,36 @@ append:
 	return in->count;
 }
 
+/**
+ * tap_add_packet() - Queue one frame from tap/guest for IPv4 or IPv6 handlers
+ * @c:		Execution context
+ * @l2len:	Total L2 frame length
+ * @p:		Frame, starting from Ethernet header
+ */
+static void tap_add_packet(struct ctx *c, ssize_t l2len, char *p)
+{
+	const struct ethhdr *eh = (struct ethhdr *)p;
+
+	pcap(p, l2len);
+
+	if (memcmp(c->mac_guest, eh->h_source, ETH_ALEN)) {
+		memcpy(c->mac_guest, eh->h_source, ETH_ALEN);
+		proto_update_l2_buf(c->mac_guest, NULL);
+	}
+
+	switch (ntohs(eh->h_proto)) {
+	case ETH_P_ARP:
+	case ETH_P_IP:
+		packet_add(pool_tap4, l2len, p);
+		break;
+	case ETH_P_IPV6:
+		packet_add(pool_tap6, l2len, p);
+		break;
+	default:
+		break;
+	}
+}
+
 /**
  * tap_sock_reset() - Handle closing or failure of connect AF_UNIX socket
  * @c:		Execution context
@@ -936,6 +1201,85 @@ static void tap_sock_reset(struct ctx *c)
 	c->fd_tap = -1;
 }
 
+/**
+ * tap_dgram_learn_peer() - Reply to source of frames on unconnected socket
+ * @len:	Length of source address from recvmmsg()
+ */
+static void tap_dgram_learn_peer(socklen_t len)
+{
+	/* Unnamed (e.g. socketpair()) sockets: connected, no address needed */
+	if (len <= sizeof(sa_family_t))
+		return;
+
+	if (len == tap_dgram_peer_len &&
+	    !memcmp(&tap_dgram_src, &tap_dgram_peer, len))
+		return;
+
+	memcpy(&tap_dgram_peer, &tap_dgram_src, len);
+	tap_dgram_peer_len = len;
+	info("Sending frames to datagram socket at %s",
+	     tap_dgram_peer.sun_path);
+}
+
+/**
+ * tap_handler_passt_msg() - Receive frames from message-based AF_UNIX socket
+ * @c:		Execution context
+ * @now:	Current timestamp
+ *
+ * #syscalls:passt recvmmsg
+ */
+static void tap_handler_passt_msg(struct ctx *c, const struct timespec *now)
+{
+	int n, i;
+
+redo:
+	pool_flush(pool_tap4);
+	pool_flush(pool_tap6);
+
+	tap_mmh_recv[0].msg_hdr.msg_namelen = sizeof(tap_dgram_src);
+
+	n = recvmmsg(c->fd_tap, tap_mmh_recv, tap_msg_count, MSG_DONTWAIT,
+		     NULL);
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+
+		/* Nothing would re-create a datagram socket: keep it */
+		if (c->sock_type == SOCK_DGRAM)
+			warn("Receive error on datagram UNIX socket: %s",
+			     strerror(errno));
+		else
+			tap_sock_reset(c);
+		return;
+	}
+
+	if (n && c->sock_type == SOCK_DGRAM)
+		tap_dgram_learn_peer(tap_mmh_recv[0].msg_hdr.msg_namelen);
+
+	for (i = 0; i < n; i++) {
+		const struct msghdr *mh = &tap_mmh_recv[i].msg_hdr;
+		ssize_t len = tap_mmh_recv[i].msg_len;
+
+		if (mh->msg_flags & MSG_TRUNC) {
+			debug("tap: dropping frame exceeding %zu bytes",
+			      tap_msg_slot);
+			continue;
+		}
+
+		if (len < (ssize_t)sizeof(struct ethhdr))
+			continue;
+
+		tap_add_packet(c, len, mh->msg_iov->iov_base);
+	}
+
+	tap4_handler(c, pool_tap4, now);
+	tap6_handler(c, pool_tap6, now);
+
+	/* We can't use EPOLLET otherwise. */
+	if (n == (int)tap_msg_count)
+		goto redo;
+}
+
 /**
  * tap_handler_passt() - Packet handler for AF_UNIX file descriptor
  * @c:		Execution context
@@ -945,15 +1289,22 @@ static void tap_sock_reset(struct ctx *c)
 void tap_handler_passt(struct ctx *c, uint32_t events,
 		       const struct timespec *now)
 {
-	const struct ethhdr *eh;
 	ssize_t n, rem;
 	char *p;
 
+	if (c->sock_type == SOCK_DGRAM && (events & EPOLLERR))
+		die("Error on datagram UNIX socket, exiting");
+
 	if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
 		tap_sock_reset(c);
 		return;
 	}
 
+	if (c->sock_type != SOCK_STREAM) {
+		tap_handler_passt_msg(c, now);
+		return;
+	}
+
 redo:
 	p = pkt_buf;
 	rem = 0;
@@ -963,7 +1314,14 @@ redo:
 
 	n = recv(c->fd_tap, p, TAP_BUF_FILL, MSG_DONTWAIT);
 	if (n < 0) {
-		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+
+		/* Nothing would re-create a datagram socket: keep it */
+		if (c->sock_type == SOCK_DGRAM)
+			warn("Receive error on datagram UNIX socket: %s",
+			     strerror(errno));
+		else
 			tap_sock_reset(c);
 		return;
 	}
@@ -986,31 +1344,10 @@ redo:
 		/* Complete the partial read above before discarding a malformed
 		 * frame, otherwise the stream will be inconsistent.
 		 */
-		if (len < (ssize_t)sizeof(*eh) || len > (ssize_t)ETH_MAX_MTU)
-			goto next;
-
-		pcap(p, len);
-
-		eh = (struct ethhdr *)p;
-
-		if (memcmp(c->mac_guest, eh->h_source, ETH_ALEN)) {
-			memcpy(c->mac_guest, eh->h_source, ETH_ALEN);
-			proto_update_l2_buf(c->mac_guest, NULL);
-		}
-
-		switch (ntohs(eh->h_proto)) {
-		case ETH_P_ARP:
-		case ETH_P_IP:
-			packet_add(pool_tap4, len, p);
-			break;
-		case ETH_P_IPV6:
-			packet_add(pool_tap6, len, p);
-			break;
-		default:
-			break;
-		}
+		if (len >= (ssize_t)sizeof(struct ethhdr) &&
+		    len <= (ssize_t)ETH_MAX_MTU)
+			tap_add_packet(c, len, p);
 
-next:
 		p += len;
 		n -= len;
 	}
@@ -1026,10 +1363,11 @@ next:
 /**
  * tap_handler_pasta() - Packet handler for /dev/net/tun file descriptor
  * @c:		Execution context
+ * @fd:		File descriptor for tuntap device, or one of its queues
  * @events:	epoll events
  * @now:	Current timestamp
  */
-void tap_handler_pasta(struct ctx *c, uint32_t events,
+void tap_handler_pasta(struct ctx *c, int fd, uint32_t events,
 		       const struct timespec *now)
 {
 	ssize_t n, len;
@@ -1044,32 +1382,10 @@ redo:
 	pool_flush(pool_tap4);
 	pool_flush(pool_tap6);
 restart:
-	while ((len = read(c->fd_tap, pkt_buf + n, TAP_BUF_BYTES - n)) > 0) {
-		const struct ethhdr *eh = (struct ethhdr *)(pkt_buf + n);
-
-		if (len < (ssize_t)sizeof(*eh) || len > (ssize_t)ETH_MAX_MTU) {
-			n += len;
-			continue;
-		}
-
-		pcap(pkt_buf + n, len);
-
-		if (memcmp(c->mac_guest, eh->h_source, ETH_ALEN)) {
-			memcpy(c->mac_guest, eh->h_source, ETH_ALEN);
-			proto_update_l2_buf(c->mac_guest, NULL);
-		}
-
-		switch (ntohs(eh->h_proto)) {
-		case ETH_P_ARP:
-		case ETH_P_IP:
-			packet_add(pool_tap4, len, pkt_buf + n);
-			break;
-		case ETH_P_IPV6:
-			packet_add(pool_tap6, len, pkt_buf + n);
-			break;
-		default:
-			break;
-		}
+	while ((len = read(fd, pkt_buf + n, TAP_BUF_BYTES - n)) > 0) {
+		if (len >= (ssize_t)sizeof(struct ethhdr) &&
+		    len <= (ssize_t)ETH_MAX_MTU)
+			tap_add_packet(c, len, pkt_buf + n);
 
 		if ((n += len) == TAP_BUF_BYTES)
 			break;
@@ -1092,13 +1408,30 @@ restart:
 	die("Error on tap device, exiting");
 }
 
+/**
+ * tap_sock_set_buf() - Set large socket buffers for AF_UNIX socket to guest
+ * @c:		Execution context
+ */
+static void tap_sock_set_buf(const struct ctx *c)
+{
+	int v = INT_MAX / 2;
+
+	if (!c->low_rmem &&
+	    setsockopt(c->fd_tap, SOL_SOCKET, SO_RCVBUF, &v, sizeof(v)))
+		trace("tap: failed to set SO_RCVBUF to %i", v);
+
+	if (!c->low_wmem &&
+	    setsockopt(c->fd_tap, SOL_SOCKET, SO_SNDBUF, &v, sizeof(v)))
+		trace("tap: failed to set SO_SNDBUF to %i", v);
+}
+
 /**
  * tap_sock_unix_init() - Create and bind AF_UNIX socket, listen for connection
  * @c:		Execution context
  */
 static void tap_sock_unix_init(struct ctx *c)
 {
-	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int fd = socket(AF_UNIX, c->sock_type, 0);
 	union epoll_ref ref = { .type = EPOLL_TYPE_TAP_LISTEN };
 	struct epoll_event ev = { 0 };
 	struct sockaddr_un addr = {
@@ -1124,7 +1457,7 @@ static void tap_sock_unix_init(struct ctx *c)
 		else
 			snprintf(path, UNIX_PATH_MAX - 1, UNIX_SOCK_PATH, i);
 
-		ex = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		ex = socket(AF_UNIX, c->sock_type | SOCK_NONBLOCK, 0);
 		if (ex < 0)
 			die("UNIX domain socket check: %s", strerror(errno));
 
@@ -1150,6 +1483,22 @@ static void tap_sock_unix_init(struct ctx *c)
 
 	info("UNIX domain socket bound at %s\n", addr.sun_path);
 
+	if (c->sock_type == SOCK_DGRAM) {
+		/* No connection: frames come from, and go to, any peer */
+		ref.type = EPOLL_TYPE_TAP_PASST;
+		ref.fd = c->fd_tap = fd;
+		tap_sock_set_buf(c);
+
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.u64 = ref.u64;
+		epoll_ctl(c->epollfd, EPOLL_CTL_ADD, c->fd_tap, &ev);
+
+		info("You can now start qemu (>= 7.2):");
+		info("    kvm ... -device virtio-net-pci,netdev=s -netdev dgram,id=s,local.type=unix,local.path=PATH,remote.type=unix,remote.path=%s",
+		     addr.sun_path);
+		return;
+	}
+
 	listen(fd, 0);
 
 	ref.fd = c->fd_tap_listen = fd;
@@ -1157,6 +1506,11 @@ static void tap_sock_unix_init(struct ctx *c)
 	ev.data.u64 = ref.u64;
 	epoll_ctl(c->epollfd, EPOLL_CTL_ADD, c->fd_tap_listen, &ev);
 
+	if (c->sock_type == SOCK_SEQPACKET) {
+		info("You can now connect a SOCK_SEQPACKET client, one frame per message");
+		return;
+	}
+
 	info("You can now start qemu (>= 7.2, with commit 13c6be96618c):");
 	info("    kvm ... -device virtio-net-pci,netdev=s -netdev stream,id=s,server=off,addr.type=unix,addr.path=%s",
 	     addr.sun_path);
@@ -1173,7 +1527,6 @@ void tap_listen_handler(struct ctx *c, uint32_t events)
 {
 	union epoll_ref ref = { .type = EPOLL_TYPE_TAP_PASST };
 	struct epoll_event ev = { 0 };
-	int v = INT_MAX / 2;
 	struct ucred ucred;
 	socklen_t len;
 
@@ -1203,13 +1556,7 @@ void tap_listen_handler(struct ctx *c, uint32_t events)
 	if (!getsockopt(c->fd_tap, SOL_SOCKET, SO_PEERCRED, &ucred, &len))
 		info("accepted connection from PID %i", ucred.pid);
 
-	if (!c->low_rmem &&
-	    setsockopt(c->fd_tap, SOL_SOCKET, SO_RCVBUF, &v, sizeof(v)))
-		trace("tap: failed to set SO_RCVBUF to %i", v);
-
-	if (!c->low_wmem &&
-	    setsockopt(c->fd_tap, SOL_SOCKET, SO_SNDBUF, &v, sizeof(v)))
-		trace("tap: failed to set SO_SNDBUF to %i", v);
+	tap_sock_set_buf(c);
 
 	ref.fd = c->fd_tap;
 	ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
@@ -1218,48 +1565,75 @@ void tap_listen_handler(struct ctx *c, uint32_t events)
 }
 
 /**
- * tap_ns_tun() - Get tuntap fd in namespace
+ * tap_ns_tun_open() - Open /dev/net/tun and attach to (or create) tap device
  * @c:		Execution context
+ * @flags:	Interface flags for TUNSETIFF
  *
- * Return: 0 on success, exits on failure
+ * Return: file descriptor, exits on failure
  *
  * #syscalls:pasta ioctl openat
  */
-static int tap_ns_tun(void *arg)
+static int tap_ns_tun_open(const struct ctx *c, short flags)
 {
-	struct ifreq ifr = { .ifr_flags = IFF_TAP | IFF_NO_PI };
-	int flags = O_RDWR | O_NONBLOCK | O_CLOEXEC;
-	struct ctx *c = (struct ctx *)arg;
-	int fd, rc;
+	struct ifreq ifr = { .ifr_flags = flags };
+	int fd;
 
-	c->fd_tap = -1;
 	memcpy(ifr.ifr_name, c->pasta_ifn, IFNAMSIZ);
-	ns_enter(c);
 
-	fd = open("/dev/net/tun", flags);
+	fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
 	if (fd < 0)
 		die("Failed to open() /dev/net/tun: %s", strerror(errno));
 
-	rc = ioctl(fd, TUNSETIFF, &ifr);
-	if (rc < 0)
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0)
 		die("TUNSETIFF failed: %s", strerror(errno));
 
+	return fd;
+}
+
+/**
+ * tap_ns_tun() - Get tuntap fd in namespace, and fds for additional queues
+ * @c:		Execution context
+ *
+ * Return: 0 on success, exits on failure
+ */
+static int tap_ns_tun(void *arg)
+{
+	struct ctx *c = (struct ctx *)arg;
+	short flags = IFF_TAP | IFF_NO_PI;
+	int fd, i;
+
+	c->fd_tap = -1;
+	ns_enter(c);
+
+	if (c->tap_queues > 1)
+		flags |= IFF_MULTI_QUEUE;
+
+	fd = tap_ns_tun_open(c, flags);
+
 	if (!(c->pasta_ifi = if_nametoindex(c->pasta_ifn)))
 		die("Tap device opened but no network interface found");
 
+	for (i = 1; i < c->tap_queues; i++)
+		c->fd_tap_queues[i - 1] = tap_ns_tun_open(c, flags);
+
 	c->fd_tap = fd;
 
 	return 0;
 }
 
 /**
- * tap_sock_tun_init() - Set up /dev/net/tun file descriptor
+ * tap_sock_tun_init() - Set up /dev/net/tun file descriptors
  * @c:		Execution context
+ *
+ * With multiple queues, the kernel spreads flows from the namespace across
+ * them: we read from all of them, but we always write to the first one, which
+ * is also @c->fd_tap.
  */
 static void tap_sock_tun_init(struct ctx *c)
 {
 	union epoll_ref ref = { .type = EPOLL_TYPE_TAP_PASTA };
 	struct epoll_event ev = { 0 };
+	int i;
 
 	NS_CALL(tap_ns_tun, c);
 	if (c->fd_tap == -1)
@@ -1271,6 +1645,45 @@ static void tap_sock_tun_init(struct ctx *c)
 	ev.events = EPOLLIN | EPOLLRDHUP;
 	ev.data.u64 = ref.u64;
 	epoll_ctl(c->epollfd, EPOLL_CTL_ADD, c->fd_tap, &ev);
+
+	for (i = 0; i < c->tap_queues - 1; i++) {
+		ref.fd = c->fd_tap_queues[i];
+		ev.data.u64 = ref.u64;
+		epoll_ctl(c->epollfd, EPOLL_CTL_ADD, ref.fd, &ev);
+	}
+
+	if (c->tap_queues > 1)
+		debug("Using %i queues on tap device", c->tap_queues);
+}
+
+/**
+ * tap_msg_init() - Set up receive slots for message-based AF_UNIX transports
+ * @c:		Execution context
+ *
+ * Frames can't exceed the MTU we advertise plus L2 header: size slots in
+ * pkt_buf for that, so that each frame is received, aligned, into its own slot.
+ */
+static void tap_msg_init(const struct ctx *c)
+{
+	size_t max = c->mtu > 0 ? (size_t)c->mtu + ETH_HLEN : ETH_MAX_MTU;
+	unsigned int i;
+
+	tap_msg_slot = ROUND_UP(MIN(max, ETH_MAX_MTU), sizeof(uint64_t));
+	tap_msg_count = MIN(ARRAY_SIZE(tap_mmh_recv),
+			    sizeof(pkt_buf) / tap_msg_slot);
+
+	for (i = 0; i < tap_msg_count; i++) {
+		tap_iov_recv[i].iov_base = pkt_buf + i * tap_msg_slot;
+		tap_iov_recv[i].iov_len = tap_msg_slot;
+
+		tap_mmh_recv[i].msg_hdr.msg_iov = &tap_iov_recv[i];
+		tap_mmh_recv[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	tap_mmh_recv[0].msg_hdr.msg_name = &tap_dgram_src;
+
+	debug("tap: receiving up to %u frames of %zu bytes per batch",
+	      tap_msg_count, tap_msg_slot);
 }
 
 /**
@@ -1282,6 +1695,27 @@ void tap_sock_init(struct ctx *c)
 	size_t sz = sizeof(pkt_buf);
 	int i;
 
+	if (c->mode == MODE_PASST && c->fd_tap != -1) {
+		socklen_t sl = sizeof(c->sock_type);
+
+		/* Transport of pre-opened socket is implied by its type */
+		if (getsockopt(c->fd_tap, SOL_SOCKET, SO_TYPE,
+			       &c->sock_type, &sl))
+			c->sock_type = SOCK_STREAM;
+	}
+
+	if (tap_has_vnet_len(c)) {
+		tap_send_frames_mode = tap_send_frames_passt;
+		tap_hdr_len = sizeof(uint32_t);
+	} else if (c->mode == MODE_PASST) {
+		tap_send_frames_mode = tap_send_frames_msg;
+		tap_hdr_len = 0;
+		tap_msg_init(c);
+	} else {
+		tap_send_frames_mode = tap_send_frames_pasta;
+		tap_hdr_len = 0;
+	}
+
 	pool_tap4_storage = PACKET_INIT(pool_tap4, TAP_MSGS, pkt_buf, sz);
 	pool_tap6_storage = PACKET_INIT(pool_tap6, TAP_MSGS, pkt_buf, sz);
 
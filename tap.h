@@ -18,9 +18,20 @@ struct tap_hdr {
 
 #define TAP_HDR_INIT(proto) { .eh.h_proto = htons_constant(proto) }
 
+/**
+ * tap_has_vnet_len() - Do frames carry a length header for the tap transport?
+ * @c:		Execution context
+ *
+ * Return: true for stream sockets (qemu), false for message-based transports
+ */
+static inline bool tap_has_vnet_len(const struct ctx *c)
+{
+	return c->mode == MODE_PASST && c->sock_type == SOCK_STREAM;
+}
+
 static inline size_t tap_hdr_len_(const struct ctx *c)
 {
-	if (c->mode == MODE_PASST)
+	if (tap_has_vnet_len(c))
 		return sizeof(struct tap_hdr);
 	else
 		return sizeof(struct ethhdr);
@@ -32,7 +43,7 @@ static inline size_t tap_hdr_len_(const struct ctx *c)
  * @taph:	Pointer to L2 and tap specific header buffer
  *
  * Returns: pointer to the start of tap frame - suitable for an
- *          iov_base to be passed to tap_send_frames())
+ *          iov_base to be passed to tap_queue())
  */
 static inline void *tap_frame_base(const struct ctx *c, struct tap_hdr *taph)
 {
@@ -47,12 +58,12 @@ static inline void *tap_frame_base(const struct ctx *c, struct tap_hdr *taph)
  *
  * Returns: length of the tap frame including L2 and tap specific
  *          headers - suitable for an iov_len to be passed to
- *          tap_send_frames()
+ *          tap_queue()
  */
 static inline size_t tap_frame_len(const struct ctx *c, struct tap_hdr *taph,
 				   size_t plen)
 {
-	if (c->mode == MODE_PASST)
+	if (tap_has_vnet_len(c))
 		taph->vnet_len = htonl(plen + sizeof(taph->eh));
 	return plen + tap_hdr_len_(c);
 }
@@ -73,12 +84,14 @@ void tap_icmp6_send(const struct ctx *c,
 		    const struct in6_addr *src, const struct in6_addr *dst,
 		    const void *in, size_t len);
 void tap_send_single(const struct ctx *c, const void *data, size_t len);
-size_t tap_send_frames(const struct ctx *c, const struct iovec *iov,
-		       size_t bufs_per_frame, size_t nframes);
+void tap_flush(const struct ctx *c);
+/* @iov and @seq, if given, need to stay valid until the next tap_flush() */
+void tap_queue(const struct ctx *c, const struct iovec *iov,
+	       uint32_t *seq, uint32_t len);
 void eth_update_mac(struct ethhdr *eh,
 		    const unsigned char *eth_d, const unsigned char *eth_s);
 void tap_listen_handler(struct ctx *c, uint32_t events);
-void tap_handler_pasta(struct ctx *c, uint32_t events,
+void tap_handler_pasta(struct ctx *c, int fd, uint32_t events,
 		       const struct timespec *now);
 void tap_handler_passt(struct ctx *c, uint32_t events,
 		       const struct timespec *now);
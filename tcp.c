@@ -227,6 +227,8 @@
  *       - in MSS-sized segments
  *       - increasing @seq_to_tap at each segment
  *       - up to window (until @seq_to_tap - @seq_ack_from_tap <= @wnd_from_tap)
+ *     - sockets are edge-triggered: repeat until the socket is drained, or
+ *       the window is exhausted, in which case set STALLED
  *     - on read error, send RST to tap/guest, close socket
  *     - on zero read, send FIN to tap/guest, set TAP_FIN_SENT
  *   - on ACK from tap/guest:
@@ -234,6 +236,8 @@
  *     - check if it's the second duplicated ACK
  *     - consume buffer by difference between new ack_seq and @seq_ack_from_tap
  *     - update @seq_ack_from_tap from ack_seq in header
+ *     - if STALLED and the window allows, or if a FIN from socket is pending,
+ *       resume sending with steps listed above
  *     - on two duplicated ACKs, reset @seq_to_tap to @seq_ack_from_tap, and
  *       resend with steps listed above
  *
@@ -299,6 +303,7 @@
 #include "log.h"
 #include "inany.h"
 #include "flow.h"
+#include "netlink.h"
 
 #include "flow_table.h"
 
@@ -307,8 +312,6 @@
 #define	TAPSIDE		1
 
 #define TCP_FRAMES_MEM			128
-#define TCP_FRAMES							\
-	(c->mode == MODE_PASST ? TCP_FRAMES_MEM : 1)
 
 #define TCP_HASH_TABLE_LOAD		70		/* % */
 #define TCP_HASH_TABLE_SIZE		(FLOW_MAX * 100 / TCP_HASH_TABLE_LOAD)
@@ -359,7 +362,10 @@ struct tcp6_l2_head {	/* For MSS6 macro: keep in sync with tcp6_l2_buf_t */
 # define KERNEL_REPORTS_SND_WND(c)	(0 && (c))
 #endif
 
+#define TCP_ACCEPT_BATCH		32	/* accept() calls per listen event */
+
 #define ACK_INTERVAL			10		/* ms */
+#define FASTOPEN_DELAY			10		/* ms, wait for data */
 #define SYN_TIMEOUT			10		/* s */
 #define ACK_TIMEOUT			2
 #define FIN_TIMEOUT			60
@@ -369,9 +375,16 @@ struct tcp6_l2_head {	/* For MSS6 macro: keep in sync with tcp6_l2_buf_t */
 #define LOW_RTT_THRESHOLD		10 /* us */
 
 /* We need to include <linux/tcp.h> for tcpi_bytes_acked, instead of
- * <netinet/tcp.h>, but that doesn't include a definition for SOL_TCP
+ * <netinet/tcp.h>, but that doesn't include a definition for SOL_TCP, nor
+ * socket states as reported in tcpi_state
  */
 #define SOL_TCP				IPPROTO_TCP
+#define TCP_SYN_SENT			2
+
+/* Linux 4.2, might be missing from older libc headers */
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT		24
+#endif
 
 #define SEQ_LE(a, b)			((b) - (a) < MAX_WINDOW)
 #define SEQ_LT(a, b)			((b) - (a) - 1 < MAX_WINDOW)
@@ -422,7 +435,8 @@ static const char *tcp_state_str[] __attribute((__unused__)) = {
 
 static const char *tcp_flag_str[] __attribute((__unused__)) = {
 	"STALLED", "LOCAL", "ACTIVE_CLOSE", "ACK_TO_TAP_DUE",
-	"ACK_FROM_TAP_DUE",
+	"ACK_FROM_TAP_DUE", "SOCK_SYN_DEFERRED", "SOCK_CONNECTING",
+	"THROTTLED",
 };
 
 /* Listening sockets, used for automatic port forwarding in pasta mode only */
@@ -434,16 +448,6 @@ static int tcp_sock_ns		[NUM_PORTS][IP_VERSIONS];
  */
 static union inany_addr low_rtt_dst[LOW_RTT_TABLE_SIZE];
 
-/**
- * tcp_buf_seq_update - Sequences to update with length of frames once sent
- * @seq:	Pointer to sequence number sent to tap-side, to be updated
- * @len:	TCP payload length
- */
-struct tcp_buf_seq_update {
-	uint32_t *seq;
-	uint16_t len;
-};
-
 /* Static buffers */
 
 /**
@@ -472,8 +476,6 @@ static struct tcp4_l2_buf_t {
 #endif
 tcp4_l2_buf[TCP_FRAMES_MEM];
 
-static struct tcp_buf_seq_update tcp4_l2_buf_seq_update[TCP_FRAMES_MEM];
-
 static unsigned int tcp4_l2_buf_used;
 
 /**
@@ -502,14 +504,15 @@ struct tcp6_l2_buf_t {
 #endif
 tcp6_l2_buf[TCP_FRAMES_MEM];
 
-static struct tcp_buf_seq_update tcp6_l2_buf_seq_update[TCP_FRAMES_MEM];
-
 static unsigned int tcp6_l2_buf_used;
 
 /* recvmsg()/sendmsg() data for tap */
 static char 		tcp_buf_discard		[MAX_WINDOW];
 static struct iovec	iov_sock		[TCP_FRAMES_MEM + 1];
 
+/* Frames filled per socket read: TCP_FRAMES_MEM for passt, 1 for pasta */
+static int tcp_frames;
+
 static struct iovec	tcp4_l2_iov		[TCP_FRAMES_MEM];
 static struct iovec	tcp6_l2_iov		[TCP_FRAMES_MEM];
 static struct iovec	tcp4_l2_flags_iov	[TCP_FRAMES_MEM];
@@ -580,6 +583,25 @@ static flow_sidx_t tc_hash[TCP_HASH_TABLE_SIZE];
 static_assert(ARRAY_SIZE(tc_hash) >= FLOW_MAX,
 	"Safe linear probing requires hash table larger than connection table");
 
+/**
+ * struct tcp_throttle - Time spent by connection with window clamped by limit
+ * @since:	Timestamp, milliseconds, of window clamp if THROTTLED is set
+ * @total:	Total throttled time, milliseconds, before @since
+ */
+static struct tcp_throttle {
+	uint32_t since;
+	uint32_t total;
+} tcp_throttle[FLOW_MAX];
+
+/* Outbound pool entry, plus one, a connection is bound to, zero if none */
+static uint8_t tcp_pool_idx[FLOW_MAX];
+
+static_assert(OUT_POOL_MAX < UINT8_MAX, "Pool index doesn't fit tcp_pool_idx");
+
+/* Count of connections bound to each outbound pool address */
+static unsigned tcp_pool_used4[OUT_POOL_MAX];
+static unsigned tcp_pool_used6[OUT_POOL_MAX];
+
 /* Pools for pre-opened sockets (in init) */
 int init_sock_pool4		[TCP_SOCK_POOL_SIZE];
 int init_sock_pool6		[TCP_SOCK_POOL_SIZE];
@@ -600,10 +622,10 @@ static uint32_t tcp_conn_epoll_events(uint8_t events, uint8_t conn_flags)
 		if (events & TAP_FIN_SENT)
 			return EPOLLET;
 
-		if (conn_flags & STALLED)
+		if (conn_flags & SOCK_CONNECTING)
 			return EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
 
-		return EPOLLIN | EPOLLRDHUP;
+		return EPOLLIN | EPOLLRDHUP | EPOLLET;
 	}
 
 	if (events == TAP_SYN_RCVD)
@@ -707,6 +729,9 @@ static void tcp_timer_ctl(const struct ctx *c, struct tcp_tap_conn *conn)
 
 	if (conn->flags & ACK_TO_TAP_DUE) {
 		it.it_value.tv_nsec = (long)ACK_INTERVAL * 1000 * 1000;
+	} else if ((conn->flags & SOCK_SYN_DEFERRED) &&
+		   (conn->events & ESTABLISHED)) {
+		it.it_value.tv_nsec = (long)FASTOPEN_DELAY * 1000 * 1000;
 	} else if (conn->flags & ACK_FROM_TAP_DUE) {
 		if (!(conn->events & ESTABLISHED))
 			it.it_value.tv_sec = SYN_TIMEOUT;
@@ -726,7 +751,7 @@ static void tcp_timer_ctl(const struct ctx *c, struct tcp_tap_conn *conn)
 }
 
 /**
- * conn_flag_do() - Set/unset given flag, log, update epoll on STALLED flag
+ * conn_flag_do() - Set/unset given flag, log, update epoll on SOCK_CONNECTING
  * @c:		Execution context
  * @conn:	Connection pointer
  * @flag:	Flag to set, or ~flag to unset
@@ -764,7 +789,7 @@ static void conn_flag_do(const struct ctx *c, struct tcp_tap_conn *conn,
 			flow_dbg(conn, "%s", tcp_flag_str[flag_index]);
 	}
 
-	if (flag == STALLED || flag == ~STALLED)
+	if (flag == ~SOCK_CONNECTING)
 		tcp_epoll_ctl(c, conn);
 
 	if (flag == ACK_FROM_TAP_DUE || flag == ACK_TO_TAP_DUE		  ||
@@ -1256,19 +1281,54 @@ static struct tcp_tap_conn *tcp_hash_lookup(const struct ctx *c,
 	return &flow->tcp;
 }
 
+/**
+ * tcp_rate_ms() - Timestamp of last token bucket refill in milliseconds
+ * @c:		Execution context
+ *
+ * Return: milliseconds from CLOCK_MONOTONIC epoch, truncated to 32 bits
+ */
+static uint32_t tcp_rate_ms(const struct ctx *c)
+{
+	const struct timespec *ts = &c->tap_rate.last;
+
+	return ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
 /**
  * tcp_flow_defer() - Deferred per-flow handling (clean up closed connections)
+ * @c:		Execution context
  * @flow:	Flow table entry for this connection
  *
  * Return: true if the flow is ready to free, false otherwise
  */
-bool tcp_flow_defer(union flow *flow)
+bool tcp_flow_defer(const struct ctx *c, union flow *flow)
 {
 	const struct tcp_tap_conn *conn = &flow->tcp;
 
+	struct tcp_throttle *t = &tcp_throttle[FLOW_IDX(conn)];
+
 	if (flow->tcp.events != CLOSED)
 		return false;
 
+	if (t->total || (conn->flags & THROTTLED)) {
+		if (conn->flags & THROTTLED)
+			t->total += tcp_rate_ms(c) - t->since;
+
+		flow_dbg(conn, "throttled by rate limit for %u ms", t->total);
+		t->total = 0;
+	}
+
+	if (tcp_pool_idx[FLOW_IDX(conn)]) {
+		unsigned i = tcp_pool_idx[FLOW_IDX(conn)] - 1;
+
+		if (CONN_V4(conn))
+			tcp_pool_used4[i]--;
+		else
+			tcp_pool_used6[i]--;
+
+		tcp_pool_idx[FLOW_IDX(conn)] = 0;
+	}
+
 	close(conn->sock);
 	if (conn->timer != -1)
 		close(conn->timer);
@@ -1284,47 +1344,38 @@ static void tcp_rst_do(struct ctx *c, struct tcp_tap_conn *conn);
 	} while (0)
 
 /**
- * tcp_l2_flags_buf_flush() - Send out buffers for segments with no data (flags)
+ * tcp_flow_evict() - Reset idle connection under flow table or file pressure
  * @c:		Execution context
+ * @flow:	Flow table entry for this connection
+ *
+ * Return: true if the connection was reset, false if it's already closed
  */
-static void tcp_l2_flags_buf_flush(const struct ctx *c)
+bool tcp_flow_evict(struct ctx *c, union flow *flow)
 {
-	tap_send_frames(c, tcp6_l2_flags_iov, 1, tcp6_l2_flags_buf_used);
-	tcp6_l2_flags_buf_used = 0;
+	struct tcp_tap_conn *conn = &flow->tcp;
 
-	tap_send_frames(c, tcp4_l2_flags_iov, 1, tcp4_l2_flags_buf_used);
-	tcp4_l2_flags_buf_used = 0;
-}
-
-/**
- * tcp_l2_data_buf_flush() - Send out buffers for segments with data
- * @c:		Execution context
- */
-static void tcp_l2_data_buf_flush(const struct ctx *c)
-{
-	unsigned i;
-	size_t m;
+	if (conn->events == CLOSED)
+		return false;
 
-	m = tap_send_frames(c, tcp6_l2_iov, 1, tcp6_l2_buf_used);
-	for (i = 0; i < m; i++)
-		*tcp6_l2_buf_seq_update[i].seq += tcp6_l2_buf_seq_update[i].len;
-	tcp6_l2_buf_used = 0;
+	flow_dbg(conn, "evicting idle connection");
+	tcp_rst(c, conn);
 
-	m = tap_send_frames(c, tcp4_l2_iov, 1, tcp4_l2_buf_used);
-	for (i = 0; i < m; i++)
-		*tcp4_l2_buf_seq_update[i].seq += tcp4_l2_buf_seq_update[i].len;
-	tcp4_l2_buf_used = 0;
+	return true;
 }
 
 /**
- * tcp_defer_handler() - Handler for TCP deferred tasks
+ * tcp_l2_buf_flush() - Send out queued frames, then reuse all buffers
  * @c:		Execution context
+ *
+ * Frames are queued to tap as they're prepared, and sent at the end of each
+ * main loop iteration, but buffers are reclaimed only once we run out of them.
  */
-/* cppcheck-suppress [constParameterPointer, unmatchedSuppression] */
-void tcp_defer_handler(struct ctx *c)
+static void tcp_l2_buf_flush(const struct ctx *c)
 {
-	tcp_l2_flags_buf_flush(c);
-	tcp_l2_data_buf_flush(c);
+	tap_flush(c);
+
+	tcp4_l2_buf_used = tcp6_l2_buf_used = 0;
+	tcp4_l2_flags_buf_used = tcp6_l2_flags_buf_used = 0;
 }
 
 /**
@@ -1378,7 +1429,7 @@ static size_t tcp_fill_headers4(const struct ctx *c,
 	iph->daddr = c->ip4.addr_seen.s_addr;
 
 	iph->check = check ? *check :
-			     csum_ip4_header(iph->tot_len, IPPROTO_TCP,
+			     csum_ip4_header(iph->tot_len, 0, IPPROTO_TCP,
 					     *a4, c->ip4.addr_seen);
 
 	tcp_fill_header(th, conn, seq);
@@ -1467,6 +1518,92 @@ static size_t tcp_l2_buf_fill_headers(const struct ctx *c,
 	return tlen;
 }
 
+/**
+ * tcp_rate_wnd() - Clamp window to tap to tokens left for data from guest
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @wnd:	Window to tap, from socket, not scaled
+ *
+ * Data already received but not acknowledged was accounted for as it was
+ * written to the socket, so only new data beyond it is limited. If the window
+ * is closed, ACK_TO_TAP_DUE makes the timer reopen it as tokens are refilled.
+ *
+ * Return: clamped window, not scaled
+ */
+static uint32_t tcp_rate_wnd(const struct ctx *c, struct tcp_tap_conn *conn,
+			     uint32_t wnd)
+{
+	struct tcp_throttle *t = &tcp_throttle[FLOW_IDX(conn)];
+	int64_t tokens = MAX(c->tap_rate.tokens, 0);
+	uint32_t limit;
+
+	limit = MIN(conn->seq_from_tap - conn->seq_ack_to_tap + tokens,
+		    MAX_WINDOW);
+
+	if (wnd > limit) {
+		if (!(conn->flags & THROTTLED)) {
+			t->since = tcp_rate_ms(c);
+			conn_flag(c, conn, THROTTLED);
+		}
+
+		wnd = limit;
+		conn->wnd_to_tap = MIN(wnd >> conn->ws_to_tap, USHRT_MAX);
+		if (!conn->wnd_to_tap)
+			conn_flag(c, conn, ACK_TO_TAP_DUE);
+	} else if (conn->flags & THROTTLED) {
+		t->total += tcp_rate_ms(c) - t->since;
+		conn_flag(c, conn, ~THROTTLED);
+	}
+
+	return wnd;
+}
+
+/**
+ * tcp_queue_wnd() - Clamp window to tap to limit queueing delay in socket
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @tinfo:	tcp_info for socket
+ * @wnd:	Window to tap, not scaled
+ *
+ * Unsent bytes in the socket, over the pacing rate, are the time new data from
+ * the guest would wait in the kernel: allow only as much new data as the
+ * socket drains in the target delay, similar to what TCP_NOTSENT_LOWAT does
+ * for local senders. If the window closes, it's checked again on ACK_INTERVAL,
+ * so the allowance covers at least that, to keep the socket busy meanwhile.
+ *
+ * Return: clamped window, not scaled
+ */
+static uint32_t tcp_queue_wnd(const struct ctx *c,
+			      const struct tcp_tap_conn *conn,
+			      const struct tcp_info *tinfo, uint32_t wnd)
+{
+#ifdef HAS_NOTSENT_BYTES
+	uint64_t rate = tinfo->tcpi_pacing_rate, target, limit;
+
+	/* No estimate without RTT samples */
+	if (!rate || rate == ~0ULL)
+		return wnd;
+
+	target = rate * MAX(c->tcp.queue_delay, ACK_INTERVAL) / 1000;
+	target = MAX(target, WINDOW_DEFAULT);
+
+	if (tinfo->tcpi_notsent_bytes >= target)
+		limit = 0;
+	else
+		limit = target - tinfo->tcpi_notsent_bytes;
+
+	limit += conn->seq_from_tap - conn->seq_ack_to_tap;
+
+	return MIN(wnd, limit);
+#else
+	(void)c;
+	(void)conn;
+	(void)tinfo;
+
+	return wnd;
+#endif
+}
+
 /**
  * tcp_update_seqack_wnd() - Update ACK sequence and window to guest/tap
  * @c:		Execution context
@@ -1540,8 +1677,11 @@ static int tcp_update_seqack_wnd(const struct ctx *c, struct tcp_tap_conn *conn,
 	}
 #endif
 
+	if (c->tcp.queue_delay && !(conn->flags & LOCAL))
+		new_wnd_to_tap = tcp_queue_wnd(c, conn, tinfo, new_wnd_to_tap);
+
 	new_wnd_to_tap = MIN(new_wnd_to_tap, MAX_WINDOW);
-	if (!(conn->events & ESTABLISHED))
+	if (!(conn->events & ESTABLISHED) || (conn->flags & SOCK_CONNECTING))
 		new_wnd_to_tap = MAX(new_wnd_to_tap, WINDOW_DEFAULT);
 
 	conn->wnd_to_tap = MIN(new_wnd_to_tap >> conn->ws_to_tap, USHRT_MAX);
@@ -1557,6 +1697,10 @@ static int tcp_update_seqack_wnd(const struct ctx *c, struct tcp_tap_conn *conn,
 		conn_flag(c, conn, ACK_TO_TAP_DUE);
 
 out:
+	if (c->tap_rate.rate && (conn->events & ESTABLISHED) &&
+	    !(conn->flags & LOCAL))
+		new_wnd_to_tap = tcp_rate_wnd(c, conn, new_wnd_to_tap);
+
 	return new_wnd_to_tap       != prev_wnd_to_tap ||
 	       conn->seq_ack_to_tap != prev_ack_to_tap;
 }
@@ -1700,24 +1844,28 @@ static int tcp_send_flag(struct ctx *c, struct tcp_tap_conn *conn, int flags)
 	if (th->fin || th->syn)
 		conn->seq_to_tap++;
 
+	tap_queue(c, iov, NULL, 0);
+
 	if (CONN_V4(conn)) {
 		if (flags & DUP_ACK) {
 			memcpy(b4 + 1, b4, sizeof(*b4));
 			(iov + 1)->iov_len = iov->iov_len;
+			tap_queue(c, iov + 1, NULL, 0);
 			tcp4_l2_flags_buf_used++;
 		}
 
 		if (tcp4_l2_flags_buf_used > ARRAY_SIZE(tcp4_l2_flags_buf) - 2)
-			tcp_l2_flags_buf_flush(c);
+			tcp_l2_buf_flush(c);
 	} else {
 		if (flags & DUP_ACK) {
 			memcpy(b6 + 1, b6, sizeof(*b6));
 			(iov + 1)->iov_len = iov->iov_len;
+			tap_queue(c, iov + 1, NULL, 0);
 			tcp6_l2_flags_buf_used++;
 		}
 
 		if (tcp6_l2_flags_buf_used > ARRAY_SIZE(tcp6_l2_flags_buf) - 2)
-			tcp_l2_flags_buf_flush(c);
+			tcp_l2_buf_flush(c);
 	}
 
 	return 0;
@@ -1838,6 +1986,7 @@ static int tcp_conn_new_sock(const struct ctx *c, sa_family_t af)
 		return -errno;
 
 	tcp_sock_set_bufsize(c, s);
+	sock_set_busy_poll(c, s);
 
 	return s;
 }
@@ -1895,54 +2044,125 @@ static uint16_t tcp_conn_tap_mss(const struct tcp_tap_conn *conn,
 	return MIN(mss, USHRT_MAX);
 }
 
+/**
+ * tcp_pool_pick() - Pick outbound pool address for a new connection
+ * @c:		Execution context
+ * @conn:	Connection pointer, with addresses and ports already set
+ * @used:	Count of connections bound to each pool address
+ * @n:		Number of addresses in pool
+ *
+ * Two candidates are derived from the connection hash, and we take the one
+ * with fewer connections bound: this keeps the choice stable for a given
+ * connection, while evening out the load on ephemeral ports across addresses,
+ * also with many connections to a single destination address and port.
+ *
+ * Return: index of selected pool address
+ */
+static int tcp_pool_pick(const struct ctx *c, const struct tcp_tap_conn *conn,
+			 const unsigned *used, int n)
+{
+	uint64_t hash = tcp_conn_hash(c, conn);
+	int a = hash % n, b = (hash >> 32) % n;
+
+	return used[b] < used[a] ? b : a;
+}
+
+/**
+ * tcp_bind_no_port() - Let the kernel pick the source port at connect() time
+ * @conn:	Connection pointer
+ * @s:		Outbound TCP socket, not bound yet
+ *
+ * Without IP_BIND_ADDRESS_NO_PORT, bind() to a given address with a zero port
+ * reserves a port that can't be shared with any other destination, which
+ * quickly exhausts ephemeral ports if we open many connections.
+ */
+static void tcp_bind_no_port(const struct tcp_tap_conn *conn, int s)
+{
+	int one = 1;
+
+	if (setsockopt(s, SOL_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)))
+		flow_trace(conn, "failed to set IP_BIND_ADDRESS_NO_PORT");
+}
+
 /**
  * tcp_bind_outbound() - Bind socket to outbound address and interface if given
  * @c:		Execution context
+ * @conn:	Connection pointer
  * @s:		Outbound TCP socket
  * @af:		Address family
  */
-static void tcp_bind_outbound(const struct ctx *c, int s, sa_family_t af)
+static void tcp_bind_outbound(const struct ctx *c,
+			      const struct tcp_tap_conn *conn, int s,
+			      sa_family_t af)
 {
 	if (af == AF_INET) {
-		if (!IN4_IS_ADDR_UNSPECIFIED(&c->ip4.addr_out)) {
-			struct sockaddr_in addr4 = {
-				.sin_family = AF_INET,
-				.sin_port = 0,
-				.sin_addr = c->ip4.addr_out,
-			};
+		struct sockaddr_in addr4 = {
+			.sin_family = AF_INET,
+			.sin_port = 0,
+			.sin_addr = c->ip4.addr_out,
+		};
+		const char *ifname = c->ip4.ifname_out;
+		int i = -1;
+
+		if (c->ip4.pool_out_n) {
+			i = tcp_pool_pick(c, conn, tcp_pool_used4,
+					  c->ip4.pool_out_n);
+			addr4.sin_addr = c->ip4.pool_out[i];
+			if (*c->ip4.pool_ifname_out[i])
+				ifname = c->ip4.pool_ifname_out[i];
+		}
+
+		if (!IN4_IS_ADDR_UNSPECIFIED(&addr4.sin_addr)) {
+			tcp_bind_no_port(conn, s);
 
 			if (bind(s, (struct sockaddr *)&addr4, sizeof(addr4))) {
 				debug("Can't bind IPv4 TCP socket address: %s",
 				      strerror(errno));
+			} else if (i >= 0) {
+				tcp_pool_used4[i]++;
+				tcp_pool_idx[FLOW_IDX(conn)] = i + 1;
 			}
 		}
 
-		if (*c->ip4.ifname_out) {
+		if (*ifname) {
 			if (setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE,
-				       c->ip4.ifname_out,
-				       strlen(c->ip4.ifname_out))) {
+				       ifname, strlen(ifname))) {
 				debug("Can't bind IPv4 TCP socket to interface:"
 				      " %s", strerror(errno));
 			}
 		}
 	} else if (af == AF_INET6) {
-		if (!IN6_IS_ADDR_UNSPECIFIED(&c->ip6.addr_out)) {
-			struct sockaddr_in6 addr6 = {
-				.sin6_family = AF_INET6,
-				.sin6_port = 0,
-				.sin6_addr = c->ip6.addr_out,
-			};
+		struct sockaddr_in6 addr6 = {
+			.sin6_family = AF_INET6,
+			.sin6_port = 0,
+			.sin6_addr = c->ip6.addr_out,
+		};
+		const char *ifname = c->ip6.ifname_out;
+		int i = -1;
+
+		if (c->ip6.pool_out_n) {
+			i = tcp_pool_pick(c, conn, tcp_pool_used6,
+					  c->ip6.pool_out_n);
+			addr6.sin6_addr = c->ip6.pool_out[i];
+			if (*c->ip6.pool_ifname_out[i])
+				ifname = c->ip6.pool_ifname_out[i];
+		}
+
+		if (!IN6_IS_ADDR_UNSPECIFIED(&addr6.sin6_addr)) {
+			tcp_bind_no_port(conn, s);
 
 			if (bind(s, (struct sockaddr *)&addr6, sizeof(addr6))) {
 				debug("Can't bind IPv6 TCP socket address: %s",
 				      strerror(errno));
+			} else if (i >= 0) {
+				tcp_pool_used6[i]++;
+				tcp_pool_idx[FLOW_IDX(conn)] = i + 1;
 			}
 		}
 
-		if (*c->ip6.ifname_out) {
+		if (*ifname) {
 			if (setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE,
-				       c->ip6.ifname_out,
-				       strlen(c->ip6.ifname_out))) {
+				       ifname, strlen(ifname))) {
 				debug("Can't bind IPv6 TCP socket to interface:"
 				      " %s", strerror(errno));
 			}
@@ -1950,19 +2170,84 @@ static void tcp_bind_outbound(const struct ctx *c, int s, sa_family_t af)
 	}
 }
 
+/**
+ * tcp_fastopen_connect() - Defer SYN to first write, to carry data, if possible
+ * @c:		Execution context
+ * @s:		Outbound TCP socket, not connected yet
+ *
+ * With TCP_FASTOPEN_CONNECT, connect() returns right away if we have a Fast
+ * Open cookie for the destination, and the SYN is sent, with data, on the first
+ * write. Otherwise, the connection proceeds as usual, requesting a cookie.
+ *
+ * Return: true if the option is set, false otherwise
+ */
+static bool tcp_fastopen_connect(const struct ctx *c, int s)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+	int one = 1;
+
+	if (!c->tcp.fastopen)
+		return false;
+
+	if (!setsockopt(s, SOL_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)))
+		return true;
+
+	debug("TCP: can't set TCP_FASTOPEN_CONNECT on socket %i: %s", s,
+	      strerror(errno));
+#else
+	(void)c;
+	(void)s;
+#endif
+	return false;
+}
+
+/**
+ * tcp_sock_set_dscp() - Set DSCP from guest on socket, ECN is up to the kernel
+ * @s:		Socket
+ * @af:		Address family, AF_INET or AF_INET6
+ * @tos:	IPv4 Type of Service or IPv6 Traffic Class from guest
+ */
+static void tcp_sock_set_dscp(int s, sa_family_t af, uint8_t tos)
+{
+	int dscp = tos & ~IPTOS_ECN_MASK;
+
+	if (!dscp)
+		return;
+
+	if (af == AF_INET)
+		setsockopt(s, IPPROTO_IP, IP_TOS, &dscp, sizeof(dscp));
+	else
+		setsockopt(s, IPPROTO_IPV6, IPV6_TCLASS, &dscp, sizeof(dscp));
+}
+
+/**
+ * tcp_fastopen_kick() - Send deferred SYN to socket without waiting for data
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ */
+static void tcp_fastopen_kick(struct ctx *c, struct tcp_tap_conn *conn)
+{
+	struct msghdr mh = { 0 };
+
+	/* Zero-length write: fails with EINPROGRESS, but sends the SYN */
+	sendmsg(conn->sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	conn_flag(c, conn, ~SOCK_SYN_DEFERRED);
+}
+
 /**
  * tcp_conn_from_tap() - Handle connection request (SYN segment) from tap
  * @c:		Execution context
  * @af:		Address family, AF_INET or AF_INET6
  * @saddr:	Source address, pointer to in_addr or in6_addr
  * @daddr:	Destination address, pointer to in_addr or in6_addr
+ * @tos:	IPv4 Type of Service or IPv6 Traffic Class of SYN segment
  * @th:		TCP header from tap: caller MUST ensure it's there
  * @opts:	Pointer to start of options
  * @optlen:	Bytes in options: caller MUST ensure available length
  * @now:	Current timestamp
  */
 static void tcp_conn_from_tap(struct ctx *c, sa_family_t af,
-			      const void *saddr, const void *daddr,
+			      const void *saddr, const void *daddr, uint8_t tos,
 			      const struct tcphdr *th, const char *opts,
 			      size_t optlen, const struct timespec *now)
 {
@@ -1978,10 +2263,13 @@ static void tcp_conn_from_tap(struct ctx *c, sa_family_t af,
 		.sin6_port = htons(dstport),
 		.sin6_addr = *(struct in6_addr *)daddr,
 	};
+	in_port_t natport = dstport;
+	union inany_addr nataddr;
 	const struct sockaddr *sa;
 	struct tcp_tap_conn *conn;
+	bool fastopen = false;
 	union flow *flow;
-	int s = -1, mss;
+	int s = -1, mss, local;
 	socklen_t sl;
 
 	if (!(flow = flow_alloc()))
@@ -2022,7 +2310,19 @@ static void tcp_conn_from_tap(struct ctx *c, sa_family_t af,
 	if ((s = tcp_conn_sock(c, af)) < 0)
 		goto cancel;
 
-	if (!c->no_map_gw) {
+	tcp_sock_set_dscp(s, af, tos);
+
+	inany_from_af(&nataddr, af, daddr);
+	if (fwd_nat_lookup(&c->nat, PIF_TAP, IPPROTO_TCP, &nataddr.a6,
+			   &natport)) {
+		if (af == AF_INET) {
+			addr4.sin_addr = *inany_v4(&nataddr);
+			addr4.sin_port = htons(natport);
+		} else {
+			addr6.sin6_addr = nataddr.a6;
+			addr6.sin6_port = htons(natport);
+		}
+	} else if (!c->no_map_gw) {
 		if (af == AF_INET && IN4_ARE_ADDR_EQUAL(daddr, &c->ip4.gw))
 			addr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 		if (af == AF_INET6 && INANY_ARE_ADDR_EQUAL(daddr, &c->ip6.gw))
@@ -2081,17 +2381,27 @@ static void tcp_conn_from_tap(struct ctx *c, sa_family_t af,
 
 	tcp_hash_insert(c, conn);
 
-	if (!bind(s, sa, sl)) {
-		tcp_rst(c, conn);	/* Nobody is listening then */
-		return;
+	if ((local = nl_addr_local(af, af == AF_INET ?
+					(void *)&addr4.sin_addr :
+					(void *)&addr6.sin6_addr)) < 0) {
+		/* No cached information: probe with bind() */
+		if (!bind(s, sa, sl)) {
+			tcp_rst(c, conn);	/* Nobody is listening then */
+			return;
+		}
+		local = errno != EADDRNOTAVAIL && errno != EACCES;
 	}
-	if (errno != EADDRNOTAVAIL && errno != EACCES)
+	if (local)
 		conn_flag(c, conn, LOCAL);
 
 	if ((af == AF_INET &&  !IN4_IS_ADDR_LOOPBACK(&addr4.sin_addr)) ||
 	    (af == AF_INET6 && !IN6_IS_ADDR_LOOPBACK(&addr6.sin6_addr) &&
 			       !IN6_IS_ADDR_LINKLOCAL(&addr6.sin6_addr)))
-		tcp_bind_outbound(c, s, af);
+		tcp_bind_outbound(c, conn, s, af);
+
+	/* Nothing to save on round-trips for local destinations */
+	if (!local)
+		fastopen = tcp_fastopen_connect(c, s);
 
 	if (connect(s, sa, sl)) {
 		if (errno != EINPROGRESS) {
@@ -2103,6 +2413,12 @@ static void tcp_conn_from_tap(struct ctx *c, sa_family_t af,
 	} else {
 		tcp_get_sndbuf(conn);
 
+		/* Not actually connected: SYN goes out with the first data */
+		if (fastopen) {
+			conn_flag(c, conn, SOCK_SYN_DEFERRED);
+			conn_flag(c, conn, SOCK_CONNECTING);
+		}
+
 		if (tcp_send_flag(c, conn, SYN | ACK))
 			return;
 
@@ -2162,32 +2478,27 @@ static int tcp_sock_consume(const struct tcp_tap_conn *conn, uint32_t ack_seq)
 static void tcp_data_to_tap(const struct ctx *c, struct tcp_tap_conn *conn,
 			    ssize_t plen, int no_csum, uint32_t seq)
 {
-	uint32_t *seq_update = &conn->seq_to_tap;
 	struct iovec *iov;
 
 	if (CONN_V4(conn)) {
 		struct tcp4_l2_buf_t *b = &tcp4_l2_buf[tcp4_l2_buf_used];
 		const uint16_t *check = no_csum ? &(b - 1)->iph.check : NULL;
 
-		tcp4_l2_buf_seq_update[tcp4_l2_buf_used].seq = seq_update;
-		tcp4_l2_buf_seq_update[tcp4_l2_buf_used].len = plen;
-
 		iov = tcp4_l2_iov + tcp4_l2_buf_used++;
 		iov->iov_len = tcp_l2_buf_fill_headers(c, conn, b, plen,
 						       check, seq);
+		tap_queue(c, iov, &conn->seq_to_tap, plen);
 		if (tcp4_l2_buf_used > ARRAY_SIZE(tcp4_l2_buf) - 1)
-			tcp_l2_data_buf_flush(c);
+			tcp_l2_buf_flush(c);
 	} else if (CONN_V6(conn)) {
 		struct tcp6_l2_buf_t *b = &tcp6_l2_buf[tcp6_l2_buf_used];
 
-		tcp6_l2_buf_seq_update[tcp6_l2_buf_used].seq = seq_update;
-		tcp6_l2_buf_seq_update[tcp6_l2_buf_used].len = plen;
-
 		iov = tcp6_l2_iov + tcp6_l2_buf_used++;
 		iov->iov_len = tcp_l2_buf_fill_headers(c, conn, b, plen,
 						       NULL, seq);
+		tap_queue(c, iov, &conn->seq_to_tap, plen);
 		if (tcp6_l2_buf_used > ARRAY_SIZE(tcp6_l2_buf) - 1)
-			tcp_l2_data_buf_flush(c);
+			tcp_l2_buf_flush(c);
 	}
 }
 
@@ -2196,21 +2507,27 @@ static void tcp_data_to_tap(const struct ctx *c, struct tcp_tap_conn *conn,
  * @c:		Execution context
  * @conn:	Connection pointer
  *
+ * Established sockets are edge-triggered, so we keep going as long as there's
+ * window and data to send, and set STALLED if data might be left in the socket
+ * because the window is exhausted: see tcp_data_from_sock_pending().
+ *
  * Return: negative on connection reset, 0 otherwise
  *
  * #syscalls recvmsg
  */
 static int tcp_data_from_sock(struct ctx *c, struct tcp_tap_conn *conn)
 {
-	uint32_t wnd_scaled = conn->wnd_from_tap << conn->ws_from_tap;
-	int fill_bufs, send_bufs = 0, last_len, iov_rem = 0;
+	int fill_bufs, send_bufs, last_len, iov_rem;
 	int sendlen, len, plen, v4 = CONN_V4(conn);
 	int s = conn->sock, i, ret = 0;
 	struct msghdr mh_sock = { 0 };
 	uint16_t mss = MSS_GET(conn);
 	uint32_t already_sent, seq;
+	uint32_t wnd_scaled;
 	struct iovec *iov;
 
+again:
+	wnd_scaled = conn->wnd_from_tap << conn->ws_from_tap;
 	already_sent = conn->seq_to_tap - conn->seq_ack_from_tap;
 
 	if (SEQ_LT(already_sent, 0)) {
@@ -2229,8 +2546,8 @@ static int tcp_data_from_sock(struct ctx *c, struct tcp_tap_conn *conn)
 
 	/* Set up buffer descriptors we'll fill completely and partially. */
 	fill_bufs = DIV_ROUND_UP(wnd_scaled - already_sent, mss);
-	if (fill_bufs > TCP_FRAMES) {
-		fill_bufs = TCP_FRAMES;
+	if (fill_bufs > tcp_frames) {
+		fill_bufs = tcp_frames;
 		iov_rem = 0;
 	} else {
 		iov_rem = (wnd_scaled - already_sent) % mss;
@@ -2244,7 +2561,7 @@ static int tcp_data_from_sock(struct ctx *c, struct tcp_tap_conn *conn)
 
 	if (( v4 && tcp4_l2_buf_used + fill_bufs > ARRAY_SIZE(tcp4_l2_buf)) ||
 	    (!v4 && tcp6_l2_buf_used + fill_bufs > ARRAY_SIZE(tcp6_l2_buf))) {
-		tcp_l2_data_buf_flush(c);
+		tcp_l2_buf_flush(c);
 
 		/* Silence Coverity CWE-125 false positive */
 		tcp4_l2_buf_used = tcp6_l2_buf_used = 0;
@@ -2265,6 +2582,8 @@ static int tcp_data_from_sock(struct ctx *c, struct tcp_tap_conn *conn)
 		len = recvmsg(s, &mh_sock, MSG_PEEK);
 	while (len < 0 && errno == EINTR);
 
+	conn_flag(c, conn, ~STALLED);
+
 	if (len < 0)
 		goto err;
 
@@ -2282,12 +2601,8 @@ static int tcp_data_from_sock(struct ctx *c, struct tcp_tap_conn *conn)
 	}
 
 	sendlen = len - already_sent;
-	if (sendlen <= 0) {
-		conn_flag(c, conn, STALLED);
+	if (sendlen <= 0)
 		return 0;
-	}
-
-	conn_flag(c, conn, ~STALLED);
 
 	send_bufs = DIV_ROUND_UP(sendlen, mss);
 	last_len = sendlen - (send_bufs - 1) * mss;
@@ -2310,6 +2625,22 @@ static int tcp_data_from_sock(struct ctx *c, struct tcp_tap_conn *conn)
 
 	conn_flag(c, conn, ACK_FROM_TAP_DUE);
 
+	/* We got all the data we asked for, so more might be pending, and we
+	 * won't get another event for it. If we filled all the frames we could
+	 * with window to spare, send out what we have, and retry. If the
+	 * window was the limit, or the tap couldn't take everything, wait for
+	 * the guest instead: see tcp_data_from_sock_pending().
+	 */
+	if (sendlen == (int)(wnd_scaled - already_sent)) {
+		conn_flag(c, conn, STALLED);
+	} else if (fill_bufs == tcp_frames && sendlen == fill_bufs * mss) {
+		tcp_l2_buf_flush(c);
+		if (conn->seq_to_tap == seq)
+			goto again;
+
+		conn_flag(c, conn, STALLED);
+	}
+
 	return 0;
 
 err:
@@ -2321,6 +2652,29 @@ err:
 	return ret;
 }
 
+/**
+ * tcp_data_from_sock_pending() - Resume data from socket we couldn't send yet
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ *
+ * With edge-triggered sockets, there won't be further events for data left
+ * over as the window from tap was exhausted, nor for an end-of-file we didn't
+ * forward yet: check again once the guest acknowledges data or opens the
+ * window.
+ */
+static void tcp_data_from_sock_pending(struct ctx *c,
+				       struct tcp_tap_conn *conn)
+{
+	uint32_t wnd_scaled = conn->wnd_from_tap << conn->ws_from_tap;
+
+	if ((conn->flags & STALLED) &&
+	    conn->seq_to_tap - conn->seq_ack_from_tap < wnd_scaled)
+		tcp_data_from_sock(c, conn);
+	else if ((conn->events & (SOCK_FIN_RCVD | TAP_FIN_SENT)) ==
+		 SOCK_FIN_RCVD && conn->seq_ack_from_tap == conn->seq_to_tap)
+		tcp_data_from_sock(c, conn);
+}
+
 /**
  * tcp_data_from_tap() - tap/guest data for established connection
  * @c:		Execution context
@@ -2352,26 +2706,16 @@ static int tcp_data_from_tap(struct ctx *c, struct tcp_tap_conn *conn,
 		uint32_t seq, seq_offset, ack_seq;
 		const struct tcphdr *th;
 		char *data;
-		size_t off;
-
-		th = packet_get(p, i, 0, sizeof(*th), &len);
-		if (!th)
-			return -1;
-		len += sizeof(*th);
 
-		off = th->doff * 4UL;
-		if (off < sizeof(*th) || off > len)
-			return -1;
+		/* Header and data offset already validated by tap handlers */
+		th = packet_hdr(p, i, NULL);
 
 		if (th->rst) {
 			conn_event(c, conn, CLOSED);
 			return 1;
 		}
 
-		len -= off;
-		data = packet_get(p, i, off, len, NULL);
-		if (!data)
-			continue;
+		data = packet_data(p, i, &len);
 
 		seq = ntohl(th->seq);
 		ack_seq = ntohl(th->ack_seq);
@@ -2459,6 +2803,10 @@ static int tcp_data_from_tap(struct ctx *c, struct tcp_tap_conn *conn,
 		goto out;
 
 	mh.msg_iovlen = iov_i;
+
+	/* If the SYN was deferred, it goes out now, with this data */
+	if (conn->flags & SOCK_SYN_DEFERRED)
+		conn_flag(c, conn, ~SOCK_SYN_DEFERRED);
 eintr:
 	n = sendmsg(conn->sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
 	if (n < 0) {
@@ -2474,7 +2822,8 @@ eintr:
 		if (errno == EINTR)
 			goto eintr;
 
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == EINPROGRESS) {
 			tcp_send_flag(c, conn, ACK_IF_NEEDED);
 			return p->count - idx;
 
@@ -2482,6 +2831,9 @@ eintr:
 		return -1;
 	}
 
+	if (!(conn->flags & LOCAL))
+		rate_take(&c->tap_rate, n);
+
 	if (n < (int)(seq_from_tap - conn->seq_from_tap)) {
 		partial_send = 1;
 		conn->seq_from_tap += n;
@@ -2559,6 +2911,7 @@ static void tcp_conn_from_sock_finish(struct ctx *c, struct tcp_tap_conn *conn,
  * @af:		Address family, AF_INET or AF_INET6
  * @saddr:	Source address
  * @daddr:	Destination address
+ * @tos:	IPv4 Type of Service or IPv6 Traffic Class, same for all packets
  * @p:		Pool of TCP packets, with TCP headers
  * @idx:	Index of first packet in pool to process
  * @now:	Current timestamp
@@ -2566,7 +2919,7 @@ static void tcp_conn_from_sock_finish(struct ctx *c, struct tcp_tap_conn *conn,
  * Return: count of consumed packets
  */
 int tcp_tap_handler(struct ctx *c, uint8_t pif, sa_family_t af,
-		    const void *saddr, const void *daddr,
+		    const void *saddr, const void *daddr, uint8_t tos,
 		    const struct pool *p, int idx, const struct timespec *now)
 {
 	struct tcp_tap_conn *conn;
@@ -2578,27 +2931,25 @@ int tcp_tap_handler(struct ctx *c, uint8_t pif, sa_family_t af,
 
 	(void)pif;
 
-	th = packet_get(p, idx, 0, sizeof(*th), &len);
-	if (!th)
-		return 1;
-	len += sizeof(*th);
-
-	optlen = th->doff * 4UL - sizeof(*th);
-	/* Static checkers might fail to see this: */
-	optlen = MIN(optlen, ((1UL << 4) /* from doff width */ - 6) * 4UL);
-	opts = packet_get(p, idx, sizeof(*th), optlen, NULL);
+	/* Header and options already validated by tap handlers */
+	th = packet_hdr(p, idx, &optlen);
+	opts = (const char *)(th + 1);
+	optlen -= sizeof(*th);
+	packet_data(p, idx, &len);
+	len += sizeof(*th) + optlen;
 
 	conn = tcp_hash_lookup(c, af, daddr, ntohs(th->source), ntohs(th->dest));
 
 	/* New connection from tap */
 	if (!conn) {
-		if (opts && th->syn && !th->ack)
-			tcp_conn_from_tap(c, af, saddr, daddr, th,
+		if (th->syn && !th->ack)
+			tcp_conn_from_tap(c, af, saddr, daddr, tos, th,
 					  opts, optlen, now);
 		return 1;
 	}
 
 	flow_trace(conn, "packet length %zu from tap", len);
+	FLOW_TOUCH(conn);
 
 	if (th->rst) {
 		conn_event(c, conn, CLOSED);
@@ -2628,6 +2979,16 @@ int tcp_tap_handler(struct ctx *c, uint8_t pif, sa_family_t af,
 		if (th->fin) {
 			conn->seq_from_tap++;
 
+			if (conn->flags & SOCK_CONNECTING) {
+				/* Shut down once connected: see below */
+				if (conn->flags & SOCK_SYN_DEFERRED)
+					tcp_fastopen_kick(c, conn);
+				conn_event(c, conn, TAP_FIN_RCVD);
+				tcp_send_flag(c, conn, ACK);
+
+				return 1;
+			}
+
 			shutdown(conn->sock, SHUT_WR);
 			tcp_send_flag(c, conn, ACK);
 			conn_event(c, conn, SOCK_FIN_SENT);
@@ -2640,6 +3001,10 @@ int tcp_tap_handler(struct ctx *c, uint8_t pif, sa_family_t af,
 
 		tcp_tap_window_update(conn, ntohs(th->window));
 
+		/* Give the guest some time to send data along with our SYN */
+		if (conn->flags & SOCK_SYN_DEFERRED)
+			tcp_timer_ctl(c, conn);
+
 		tcp_data_from_sock(c, conn);
 
 		if (p->count - idx == 1)
@@ -2662,12 +3027,17 @@ int tcp_tap_handler(struct ctx *c, uint8_t pif, sa_family_t af,
 	if (count == -1)
 		goto reset;
 
-	conn_flag(c, conn, ~STALLED);
+	tcp_data_from_sock_pending(c, conn);
 
 	if (conn->seq_ack_to_tap != conn->seq_from_tap)
 		ack_due = 1;
 
-	if ((conn->events & TAP_FIN_RCVD) && !(conn->events & SOCK_FIN_SENT)) {
+	/* Shutting down a socket while connecting just closes it: wait */
+	if ((conn->events & TAP_FIN_RCVD) && (conn->flags & SOCK_CONNECTING)) {
+		if (conn->flags & SOCK_SYN_DEFERRED)
+			tcp_fastopen_kick(c, conn);
+	} else if ((conn->events & TAP_FIN_RCVD) &&
+		   !(conn->events & SOCK_FIN_SENT)) {
 		shutdown(conn->sock, SHUT_WR);
 		conn_event(c, conn, SOCK_FIN_SENT);
 		tcp_send_flag(c, conn, ACK);
@@ -2688,6 +3058,34 @@ reset:
 	return p->count - idx;
 }
 
+/**
+ * tcp_fastopen_finish() - Handle completion of deferred connect() from EPOLLOUT
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ *
+ * Errors are reported as EPOLLERR, handled by the caller.
+ */
+static void tcp_fastopen_finish(struct ctx *c, struct tcp_tap_conn *conn)
+{
+	struct tcp_info tinfo;
+	socklen_t sl = sizeof(tinfo);
+
+	/* Sockets with a deferred SYN report EPOLLOUT to get written to */
+	if (getsockopt(conn->sock, SOL_TCP, TCP_INFO, &tinfo, &sl) ||
+	    tinfo.tcpi_state == TCP_SYN_SENT)
+		return;
+
+	conn_flag(c, conn, ~SOCK_CONNECTING);
+
+	if ((conn->events & TAP_FIN_RCVD) && !(conn->events & SOCK_FIN_SENT)) {
+		shutdown(conn->sock, SHUT_WR);
+		conn_event(c, conn, SOCK_FIN_SENT);
+	}
+
+	/* Window was kept at its default until now: update it */
+	tcp_send_flag(c, conn, ACK);
+}
+
 /**
  * tcp_connect_finish() - Handle completion of connect() from EPOLLOUT event
  * @c:		Execution context
@@ -2763,7 +3161,9 @@ static void tcp_tap_conn_from_sock(struct ctx *c, in_port_t dstport,
 	inany_from_sockaddr(&conn->faddr, &conn->fport, sa);
 	conn->eport = dstport + c->tcp.fwd_in.delta[dstport];
 
-	tcp_snat_inbound(c, &conn->faddr);
+	if (!fwd_nat_lookup(&c->nat, PIF_HOST, IPPROTO_TCP, &conn->faddr.a6,
+			    &conn->fport))
+		tcp_snat_inbound(c, &conn->faddr);
 
 	tcp_seq_init(c, conn, now);
 	tcp_hash_insert(c, conn);
@@ -2779,62 +3179,80 @@ static void tcp_tap_conn_from_sock(struct ctx *c, in_port_t dstport,
 }
 
 /**
- * tcp_listen_handler() - Handle new connection request from listening socket
+ * tcp_listen_handler() - Handle new connection requests from listening socket
  * @c:		Execution context
  * @ref:	epoll reference of listening socket
  * @now:	Current timestamp
+ *
+ * Accept up to TCP_ACCEPT_BATCH connections per event: under a burst of
+ * connection requests, this saves one epoll_wait() per connection, and the
+ * resulting SYN segments to tap are sent out together. Sockets inherit buffer
+ * sizes and busy polling settings from the listening socket.
  */
 void tcp_listen_handler(struct ctx *c, union epoll_ref ref,
 			const struct timespec *now)
 {
-	union sockaddr_inany sa;
-	socklen_t sl = sizeof(sa);
-	union flow *flow;
-	int s;
+	int i;
 
-	if (c->no_tcp || !(flow = flow_alloc()))
+	if (c->no_tcp)
 		return;
 
-	s = accept4(ref.fd, &sa.sa, &sl, SOCK_NONBLOCK);
-	if (s < 0)
-		goto cancel;
-
-	if (sa.sa_family == AF_INET) {
-		const struct in_addr *addr = &sa.sa4.sin_addr;
-		in_port_t port = sa.sa4.sin_port;
+	for (i = 0; i < TCP_ACCEPT_BATCH; i++) {
+		union sockaddr_inany sa;
+		socklen_t sl = sizeof(sa);
+		union flow *flow;
+		int s;
 
-		if (IN4_IS_ADDR_UNSPECIFIED(addr) ||
-		    IN4_IS_ADDR_BROADCAST(addr) ||
-		    IN4_IS_ADDR_MULTICAST(addr) || port == 0) {
-			char str[INET_ADDRSTRLEN];
+		if (!(flow = flow_alloc()))
+			return;
 
-			err("Invalid endpoint from TCP accept(): %s:%hu",
-			    inet_ntop(AF_INET, addr, str, sizeof(str)), port);
-			goto cancel;
+		s = accept4(ref.fd, &sa.sa, &sl, SOCK_NONBLOCK);
+		if (s < 0) {
+			flow_alloc_cancel(flow);
+			return;
 		}
-	} else if (sa.sa_family == AF_INET6) {
-		const struct in6_addr *addr = &sa.sa6.sin6_addr;
-		in_port_t port = sa.sa6.sin6_port;
 
-		if (IN6_IS_ADDR_UNSPECIFIED(addr) ||
-		    IN6_IS_ADDR_MULTICAST(addr) || port == 0) {
-			char str[INET6_ADDRSTRLEN];
+		if (sa.sa_family == AF_INET) {
+			const struct in_addr *addr = &sa.sa4.sin_addr;
+			in_port_t port = sa.sa4.sin_port;
 
-			err("Invalid endpoint from TCP accept(): %s:%hu",
-			    inet_ntop(AF_INET6, addr, str, sizeof(str)), port);
-			goto cancel;
+			if (IN4_IS_ADDR_UNSPECIFIED(addr) ||
+			    IN4_IS_ADDR_BROADCAST(addr) ||
+			    IN4_IS_ADDR_MULTICAST(addr) || port == 0) {
+				char str[INET_ADDRSTRLEN];
+
+				err("Invalid endpoint from TCP accept(): %s:%hu",
+				    inet_ntop(AF_INET, addr, str, sizeof(str)),
+				    port);
+				goto cancel;
+			}
+		} else if (sa.sa_family == AF_INET6) {
+			const struct in6_addr *addr = &sa.sa6.sin6_addr;
+			in_port_t port = sa.sa6.sin6_port;
+
+			if (IN6_IS_ADDR_UNSPECIFIED(addr) ||
+			    IN6_IS_ADDR_MULTICAST(addr) || port == 0) {
+				char str[INET6_ADDRSTRLEN];
+
+				err("Invalid endpoint from TCP accept(): %s:%hu",
+				    inet_ntop(AF_INET6, addr, str, sizeof(str)),
+				    port);
+				goto cancel;
+			}
 		}
-	}
 
-	if (tcp_splice_conn_from_sock(c, ref.tcp_listen.pif,
-				      ref.tcp_listen.port, flow, s, &sa))
-		return;
+		if (tcp_splice_conn_from_sock(c, ref.tcp_listen.pif,
+					      ref.tcp_listen.port, flow, s, &sa))
+			continue;
 
-	tcp_tap_conn_from_sock(c, ref.tcp_listen.port, flow, s, &sa, now);
-	return;
+		tcp_tap_conn_from_sock(c, ref.tcp_listen.port, flow, s, &sa,
+				       now);
+		continue;
 
 cancel:
-	flow_alloc_cancel(flow);
+		close(s);
+		flow_alloc_cancel(flow);
+	}
 }
 
 /**
@@ -2860,6 +3278,11 @@ void tcp_timer_handler(struct ctx *c, union epoll_ref ref)
 	if (check_armed.it_value.tv_sec || check_armed.it_value.tv_nsec)
 		return;
 
+	if ((conn->flags & SOCK_SYN_DEFERRED) && (conn->events & ESTABLISHED)) {
+		flow_dbg(conn, "no data from tap, sending SYN without it");
+		tcp_fastopen_kick(c, conn);
+	}
+
 	if (conn->flags & ACK_TO_TAP_DUE) {
 		tcp_send_flag(c, conn, ACK_IF_NEEDED);
 		tcp_timer_ctl(c, conn);
@@ -2914,6 +3337,8 @@ void tcp_sock_handler(struct ctx *c, union epoll_ref ref, uint32_t events)
 	if (conn->events == CLOSED)
 		return;
 
+	FLOW_TOUCH(conn);
+
 	if (events & EPOLLERR) {
 		tcp_rst(c, conn);
 		return;
@@ -2925,6 +3350,9 @@ void tcp_sock_handler(struct ctx *c, union epoll_ref ref, uint32_t events)
 	}
 
 	if (conn->events & ESTABLISHED) {
+		if ((conn->flags & SOCK_CONNECTING) && (events & EPOLLOUT))
+			tcp_fastopen_finish(c, conn);
+
 		if (CONN_HAS(conn, SOCK_FIN_SENT | TAP_FIN_ACKED))
 			conn_event(c, conn, CLOSED);
 
@@ -3170,6 +3598,8 @@ int tcp_init(struct ctx *c)
 {
 	unsigned b;
 
+	tcp_frames = c->mode == MODE_PASST ? TCP_FRAMES_MEM : 1;
+
 	for (b = 0; b < TCP_HASH_TABLE_SIZE; b++)
 		tc_hash[b] = FLOW_SIDX_NONE;
 
@@ -3184,10 +3614,10 @@ int tcp_init(struct ctx *c)
 	memset(tcp_sock_init_ext,	0xff,	sizeof(tcp_sock_init_ext));
 	memset(tcp_sock_ns,		0xff,	sizeof(tcp_sock_ns));
 
-	tcp_sock_refill_init(c);
+	nl_addr_local_init(c);
 
 	if (c->mode == MODE_PASTA) {
-		tcp_splice_init(c);
+		tcp_splice_init();
 
 		NS_CALL(tcp_ns_socks_init, c);
 	}
@@ -3195,6 +3625,21 @@ int tcp_init(struct ctx *c)
 	return 0;
 }
 
+/**
+ * tcp_warm_up() - Fill pools of pre-opened sockets and pipes
+ * @c:		Execution context
+ *
+ * Not needed to set up forwarding, so it's called by main() only once the
+ * spawned command, if any, was released, to keep it off the startup path.
+ */
+void tcp_warm_up(struct ctx *c)
+{
+	tcp_sock_refill_init(c);
+
+	if (c->mode == MODE_PASTA)
+		tcp_splice_warm_up(c);
+}
+
 /**
  * tcp_port_rebind() - Rebind ports to match forward maps
  * @c:		Execution context
@@ -3277,6 +3722,10 @@ void tcp_timer(struct ctx *c, const struct timespec *now)
 		}
 	}
 
+	/* Let pools shrink as they're used, under pressure */
+	if (flow_under_pressure())
+		return;
+
 	tcp_sock_refill_init(c);
 	if (c->mode == MODE_PASTA)
 		tcp_splice_refill(c);
@@ -17,13 +17,13 @@ void tcp_listen_handler(struct ctx *c, union epoll_ref ref,
 			const struct timespec *now);
 void tcp_sock_handler(struct ctx *c, union epoll_ref ref, uint32_t events);
 int tcp_tap_handler(struct ctx *c, uint8_t pif, sa_family_t af,
-		    const void *saddr, const void *daddr,
+		    const void *saddr, const void *daddr, uint8_t tos,
 		    const struct pool *p, int idx, const struct timespec *now);
 int tcp_sock_init(const struct ctx *c, sa_family_t af, const void *addr,
 		  const char *ifname, in_port_t port);
 int tcp_init(struct ctx *c);
+void tcp_warm_up(struct ctx *c);
 void tcp_timer(struct ctx *c, const struct timespec *now);
-void tcp_defer_handler(struct ctx *c);
 
 void tcp_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s);
 
@@ -51,6 +51,8 @@ union tcp_listen_epoll_ref {
 	uint32_t u32;
 };
 
+#define QUEUE_DELAY_MAX		1000		/* ms */
+
 /**
  * struct tcp_ctx - Execution context for TCP routines
  * @port_to_tap:	Ports bound host-side, packets to tap or spliced
@@ -59,6 +61,8 @@ union tcp_listen_epoll_ref {
  * @timer_run:		Timestamp of most recent timer run
  * @kernel_snd_wnd:	Kernel reports sending window (with commit 8f7baad7f035)
  * @pipe_size:		Size of pipes for spliced connections
+ * @fastopen:		Answer SYNs from tap right away, use TCP Fast Open
+ * @queue_delay:	Target delay for data from tap in socket queues, ms, or 0
  */
 struct tcp_ctx {
 	struct fwd_ports fwd_in;
@@ -68,6 +72,8 @@ struct tcp_ctx {
 	int kernel_snd_wnd;
 #endif
 	size_t pipe_size;
+	bool fastopen;
+	int queue_delay;
 };
 
 #endif /* TCP_H */
@@ -71,11 +71,14 @@ struct tcp_tap_conn {
 	int		timer		:FD_REF_BITS;
 
 	uint8_t		flags;
-#define STALLED			BIT(0)
+#define STALLED			BIT(0)	/* Data might be pending, no window */
 #define LOCAL			BIT(1)
 #define ACTIVE_CLOSE		BIT(2)
 #define ACK_TO_TAP_DUE		BIT(3)
 #define ACK_FROM_TAP_DUE	BIT(4)
+#define SOCK_SYN_DEFERRED	BIT(5)	/* TCP_FASTOPEN_CONNECT: SYN on write */
+#define SOCK_CONNECTING		BIT(6)	/* SYN-ACK to tap before socket connect */
+#define THROTTLED		BIT(7)	/* Window to tap clamped by --rate-limit */
 
 
 #define TCP_MSS_BITS			14
@@ -155,8 +158,10 @@ struct tcp_splice_conn {
 extern int init_sock_pool4	[TCP_SOCK_POOL_SIZE];
 extern int init_sock_pool6	[TCP_SOCK_POOL_SIZE];
 
-bool tcp_flow_defer(union flow *flow);
+bool tcp_flow_defer(const struct ctx *c, union flow *flow);
+bool tcp_flow_evict(struct ctx *c, union flow *flow);
 bool tcp_splice_flow_defer(union flow *flow);
+bool tcp_splice_flow_evict(const struct ctx *c, union flow *flow);
 void tcp_splice_timer(const struct ctx *c, union flow *flow);
 int tcp_conn_pool_sock(int pool[]);
 int tcp_conn_sock(const struct ctx *c, sa_family_t af);
@@ -45,6 +45,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -60,9 +61,8 @@
 #include "flow_table.h"
 
 #define MAX_PIPE_SIZE			(8UL * 1024 * 1024)
-#define TCP_SPLICE_PIPE_POOL_SIZE	32
-#define TCP_SPLICE_CONN_PRESSURE	30	/* % of conn_count */
-#define TCP_SPLICE_FILE_PRESSURE	30	/* % of c->nofile */
+#define TCP_SPLICE_PIPE_POOL_SIZE	32	/* Refilled up to this size */
+#define TCP_SPLICE_PIPE_POOL_MAX	128	/* Can grow with recycled pipes */
 
 /* Pools for pre-opened sockets (in namespace) */
 #define TCP_SOCK_POOL_TSH		16 /* Refill in ns if > x used */
@@ -71,7 +71,7 @@ static int ns_sock_pool4	[TCP_SOCK_POOL_SIZE];
 static int ns_sock_pool6	[TCP_SOCK_POOL_SIZE];
 
 /* Pool of pre-opened pipes */
-static int splice_pipe_pool		[TCP_SPLICE_PIPE_POOL_SIZE][2];
+static int splice_pipe_pool		[TCP_SPLICE_PIPE_POOL_MAX][2];
 
 #define CONN_V6(x)			(x->flags & SPLICE_V6)
 #define CONN_V4(x)			(!CONN_V6(x))
@@ -233,6 +233,35 @@ static void conn_event_do(const struct ctx *c, struct tcp_splice_conn *conn,
 	} while (0)
 
 
+/**
+ * tcp_splice_pipe_recycle() - Return pipe to pool if empty, close it otherwise
+ * @p:		Pipe file descriptors, set to -1 on return
+ *
+ * Flushing non-empty pipes might need to block: don't recycle those.
+ *
+ * #syscalls:pasta ioctl
+ */
+static void tcp_splice_pipe_recycle(int p[2])
+{
+	int i, queued;
+
+	if (!flow_under_pressure() &&
+	    !ioctl(p[0], FIONREAD, &queued) && !queued) {
+		/* Pipes are taken from the lowest slot in use: go first */
+		for (i = 0; i < TCP_SPLICE_PIPE_POOL_MAX; i++) {
+			if (splice_pipe_pool[i][0] < 0) {
+				SWAP(splice_pipe_pool[i][0], p[0]);
+				SWAP(splice_pipe_pool[i][1], p[1]);
+				return;
+			}
+		}
+	}
+
+	close(p[0]);
+	close(p[1]);
+	p[0] = p[1] = -1;
+}
+
 /**
  * tcp_splice_flow_defer() - Deferred per-flow handling (clean up closed)
  * @flow:	Flow table entry for this connection
@@ -248,12 +277,8 @@ bool tcp_splice_flow_defer(union flow *flow)
 		return false;
 
 	for (side = 0; side < SIDES; side++) {
-		/* Flushing might need to block: don't recycle them. */
-		if (conn->pipe[side][0] >= 0) {
-			close(conn->pipe[side][0]);
-			close(conn->pipe[side][1]);
-			conn->pipe[side][0] = conn->pipe[side][1] = -1;
-		}
+		if (conn->pipe[side][0] >= 0)
+			tcp_splice_pipe_recycle(conn->pipe[side]);
 
 		if (conn->s[side] >= 0) {
 			close(conn->s[side]);
@@ -270,6 +295,26 @@ bool tcp_splice_flow_defer(union flow *flow)
 	return true;
 }
 
+/**
+ * tcp_splice_flow_evict() - Close idle connection under flow or file pressure
+ * @c:		Execution context
+ * @flow:	Flow table entry for this connection
+ *
+ * Return: true if the connection is now closing, false if it already was
+ */
+bool tcp_splice_flow_evict(const struct ctx *c, union flow *flow)
+{
+	struct tcp_splice_conn *conn = &flow->tcp_splice;
+
+	if (conn->flags & CLOSING)
+		return false;
+
+	flow_dbg(conn, "evicting idle connection");
+	conn_flag(c, conn, CLOSING);
+
+	return true;
+}
+
 /**
  * tcp_splice_connect_finish() - Completion of connect() or call on success
  * @c:		Execution context
@@ -284,7 +329,7 @@ static int tcp_splice_connect_finish(const struct ctx *c,
 	int i = 0;
 
 	for (side = 0; side < SIDES; side++) {
-		for (; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
+		for (; i < TCP_SPLICE_PIPE_POOL_MAX; i++) {
 			if (splice_pipe_pool[i][0] >= 0) {
 				SWAP(conn->pipe[side][0],
 				     splice_pipe_pool[i][0]);
@@ -510,6 +555,8 @@ void tcp_splice_sock_handler(struct ctx *c, union epoll_ref ref,
 	if (conn->events == SPLICE_CLOSED)
 		return;
 
+	FLOW_TOUCH(conn);
+
 	if (events & EPOLLERR) {
 		int err, rc;
 		socklen_t sl = sizeof(err);
@@ -672,33 +719,48 @@ close:
 /**
  * tcp_set_pipe_size() - Set usable pipe size, probe starting from MAX_PIPE_SIZE
  * @c:		Execution context
+ *
+ * Pipes created for a successful probe are kept as pool of pre-opened pipes,
+ * and if we fail because of the fs.pipe-max-size limit, skip directly to it
+ * instead of halving the size repeatedly.
  */
 static void tcp_set_pipe_size(struct ctx *c)
 {
-	int probe_pipe[TCP_SPLICE_PIPE_POOL_SIZE][2], i, j;
+	size_t max_size = read_file_integer("/proc/sys/fs/pipe-max-size", 0);
+	int i, j;
 
 	c->tcp.pipe_size = MAX_PIPE_SIZE;
 
 smaller:
 	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
-		if (pipe2(probe_pipe[i], O_CLOEXEC)) {
-			i++;
+		int *p = splice_pipe_pool[i];
+
+		if (pipe2(p, O_NONBLOCK | O_CLOEXEC))
 			break;
-		}
 
-		if (fcntl(probe_pipe[i][0], F_SETPIPE_SZ, c->tcp.pipe_size) < 0)
+		if (fcntl(p[0], F_SETPIPE_SZ, c->tcp.pipe_size) < 0) {
+			close(p[0]);
+			close(p[1]);
+			p[0] = p[1] = -1;
 			break;
+		}
 	}
 
+	if (i == TCP_SPLICE_PIPE_POOL_SIZE)
+		return;
+
 	for (j = i - 1; j >= 0; j--) {
-		close(probe_pipe[j][0]);
-		close(probe_pipe[j][1]);
+		close(splice_pipe_pool[j][0]);
+		close(splice_pipe_pool[j][1]);
+		splice_pipe_pool[j][0] = splice_pipe_pool[j][1] = -1;
 	}
 
-	if (i == TCP_SPLICE_PIPE_POOL_SIZE)
-		return;
+	if (max_size && max_size < c->tcp.pipe_size / 2)
+		c->tcp.pipe_size = max_size;
+	else
+		c->tcp.pipe_size /= 2;
 
-	if (!(c->tcp.pipe_size /= 2)) {
+	if (!c->tcp.pipe_size) {
 		c->tcp.pipe_size = MAX_PIPE_SIZE;
 		return;
 	}
@@ -714,9 +776,10 @@ static void tcp_splice_pipe_refill(const struct ctx *c)
 {
 	int i;
 
+	/* Recycled pipes leave free slots anywhere: don't stop at used ones */
 	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
 		if (splice_pipe_pool[i][0] >= 0)
-			break;
+			continue;
 		if (pipe2(splice_pipe_pool[i], O_NONBLOCK | O_CLOEXEC))
 			continue;
 
@@ -770,16 +833,24 @@ void tcp_splice_refill(const struct ctx *c)
 }
 
 /**
- * tcp_splice_init() - Initialise pipe pool and size
- * @c:		Execution context
+ * tcp_splice_init() - Initialise pools of pre-opened pipes and sockets
+ *
+ * Pools are filled later, by tcp_splice_warm_up()
  */
-void tcp_splice_init(struct ctx *c)
+void tcp_splice_init(void)
 {
 	memset(splice_pipe_pool, 0xff, sizeof(splice_pipe_pool));
-	tcp_set_pipe_size(c);
-
 	memset(&ns_sock_pool4,		0xff,	sizeof(ns_sock_pool4));
 	memset(&ns_sock_pool6,		0xff,	sizeof(ns_sock_pool6));
+}
+
+/**
+ * tcp_splice_warm_up() - Probe pipe size, fill pools of pipes and sockets
+ * @c:		Execution context
+ */
+void tcp_splice_warm_up(struct ctx *c)
+{
+	tcp_set_pipe_size(c);
 	NS_CALL(tcp_sock_refill_ns, c);
 }
 
@@ -15,6 +15,7 @@ bool tcp_splice_conn_from_sock(const struct ctx *c,
 			       uint8_t pif0, in_port_t dstport,
 			       union flow *flow, int s0,
 			       const union sockaddr_inany *sa);
-void tcp_splice_init(struct ctx *c);
+void tcp_splice_init(void);
+void tcp_splice_warm_up(struct ctx *c);
 
 #endif /* TCP_SPLICE_H */
@@ -120,6 +120,7 @@
 #include "tap.h"
 #include "pcap.h"
 #include "log.h"
+#include "netlink.h"
 
 #define UDP_CONN_TIMEOUT	180 /* s, timeout for ephemeral or local bind */
 #define UDP_MAX_FRAMES		32  /* max # of frames to receive at once */
@@ -128,11 +129,13 @@
  * struct udp_tap_port - Port tracking based on tap-facing source port
  * @sock:	Socket bound to source port used as index
  * @flags:	Flags for recent activity type seen from/to port
+ * @tos:	Type of Service or Traffic Class currently set on socket
  * @ts:		Activity timestamp from tap, used for socket aging
  */
 struct udp_tap_port {
 	int sock;
 	uint8_t flags;
+	uint8_t tos;
 #define PORT_LOCAL	BIT(0)	/* Port was contacted from local address */
 #define PORT_LOOPBACK	BIT(1)	/* Port was contacted from loopback address */
 #define PORT_GUA	BIT(2)	/* Port was contacted from global unicast */
@@ -227,6 +230,47 @@ static struct iovec	udp6_l2_iov_tap		[UDP_MAX_FRAMES];
 static struct mmsghdr	udp4_l2_mh_sock		[UDP_MAX_FRAMES];
 static struct mmsghdr	udp6_l2_mh_sock		[UDP_MAX_FRAMES];
 
+/* Ancillary data from recvmmsg(): IP_TOS or IPV6_TCLASS, integer at most */
+#define UDP_CMSG_LEN		CMSG_SPACE(sizeof(int))
+
+static char udp4_l2_cmsg[UDP_MAX_FRAMES][UDP_CMSG_LEN]
+	__attribute__ ((aligned(__alignof__(struct cmsghdr))));
+static char udp6_l2_cmsg[UDP_MAX_FRAMES][UDP_CMSG_LEN]
+	__attribute__ ((aligned(__alignof__(struct cmsghdr))));
+
+/* Datagrams received at once: UDP_MAX_FRAMES for passt, 1 for pasta */
+static unsigned int udp_recv_batch;
+
+/* Frames from udp[46]_l2_buf queued to tap, not necessarily sent yet */
+static bool udp_tap_queued;
+
+/**
+ * struct udp_pace_entry - Datagram from guest held back by --rate-limit
+ * @addr:	Destination address
+ * @off:	Offset of payload in udp_pace_buf
+ * @len:	Payload length
+ * @src:	Source port, selects socket in udp_tap_map
+ * @v6:		Set for IPv6
+ * @tos:	IPv4 Type of Service or IPv6 Traffic Class
+ */
+struct udp_pace_entry {
+	union sockaddr_inany addr;
+	size_t off;
+	size_t len;
+	in_port_t src;
+	bool v6;
+	uint8_t tos;
+};
+
+/* Datagrams over --rate-limit are held back, and dropped only if these fill */
+#define UDP_PACE_FRAMES		1024
+#define UDP_PACE_BUF_SIZE	(1 << 20)	/* bytes of payload */
+
+static struct udp_pace_entry udp_pace[UDP_PACE_FRAMES];
+static char udp_pace_buf[UDP_PACE_BUF_SIZE];
+static unsigned int udp_pace_head, udp_pace_tail;	/* queued: [head, tail) */
+static unsigned long udp_pace_dropped;			/* reported by timer */
+
 /* recvmmsg()/sendmmsg() data for "spliced" connections */
 static struct iovec	udp4_iov_splice		[UDP_MAX_FRAMES];
 static struct iovec	udp6_iov_splice		[UDP_MAX_FRAMES];
@@ -318,6 +362,7 @@ static void udp_sock4_iov_init_one(const struct ctx *c, size_t i)
 	mh->msg_namelen	= sizeof(buf->s_in);
 	mh->msg_iov	= siov;
 	mh->msg_iovlen	= 1;
+	mh->msg_control	= udp4_l2_cmsg[i];
 
 	tiov->iov_base	= tap_frame_base(c, &buf->taph);
 }
@@ -346,6 +391,7 @@ static void udp_sock6_iov_init_one(const struct ctx *c, size_t i)
 	mh->msg_namelen	= sizeof(buf->s_in6);
 	mh->msg_iov	= siov;
 	mh->msg_iovlen	= 1;
+	mh->msg_control	= udp6_l2_cmsg[i];
 
 	tiov->iov_base	= tap_frame_base(c, &buf->taph);
 }
@@ -561,18 +607,46 @@ static void udp_splice_sendfrom(const struct ctx *c, unsigned start, unsigned n,
 	sendmmsg(s, mmh_send + start, n, MSG_NOSIGNAL);
 }
 
+/**
+ * udp_cmsg_tos() - Get Type of Service or Traffic Class of received datagram
+ * @mh:		Message header filled by recvmmsg()
+ *
+ * Return: IP_TOS or IPV6_TCLASS value, including ECN bits, 0 if not available
+ */
+static uint8_t udp_cmsg_tos(const struct msghdr *mh)
+{
+	const struct cmsghdr *cmsg;
+	int tclass;
+
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg;
+	     cmsg = CMSG_NXTHDR((struct msghdr *)mh, (struct cmsghdr *)cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IP &&
+		    cmsg->cmsg_type == IP_TOS)
+			return *(const uint8_t *)CMSG_DATA(cmsg);
+
+		if (cmsg->cmsg_level == IPPROTO_IPV6 &&
+		    cmsg->cmsg_type == IPV6_TCLASS) {
+			memcpy(&tclass, CMSG_DATA(cmsg), sizeof(tclass));
+			return tclass;
+		}
+	}
+
+	return 0;
+}
+
 /**
  * udp_update_hdr4() - Update headers for one IPv4 datagram
  * @c:		Execution context
  * @b:		Pointer to udp4_l2_buf to update
  * @dstport:	Destination port number
+ * @tos:	Type of Service of received datagram, including ECN bits
  * @datalen:	Length of UDP payload
  * @now:	Current timestamp
  *
  * Return: size of tap frame with headers
  */
 static size_t udp_update_hdr4(const struct ctx *c, struct udp4_l2_buf_t *b,
-			      in_port_t dstport, size_t datalen,
+			      in_port_t dstport, uint8_t tos, size_t datalen,
 			      const struct timespec *now)
 {
 	size_t ip_len = datalen + sizeof(b->iph) + sizeof(b->uh);
@@ -598,10 +672,11 @@ static size_t udp_update_hdr4(const struct ctx *c, struct udp4_l2_buf_t *b,
 		src = c->ip4.gw;
 	}
 
+	b->iph.tos = tos;
 	b->iph.tot_len = htons(ip_len);
 	b->iph.daddr = c->ip4.addr_seen.s_addr;
 	b->iph.saddr = src.s_addr;
-	b->iph.check = csum_ip4_header(b->iph.tot_len, IPPROTO_UDP,
+	b->iph.check = csum_ip4_header(b->iph.tot_len, tos, IPPROTO_UDP,
 				       src, c->ip4.addr_seen);
 
 	b->uh.source = b->s_in.sin_port;
@@ -616,13 +691,14 @@ static size_t udp_update_hdr4(const struct ctx *c, struct udp4_l2_buf_t *b,
  * @c:		Execution context
  * @b:		Pointer to udp6_l2_buf to update
  * @dstport:	Destination port number
+ * @tclass:	Traffic Class of received datagram, including ECN bits
  * @datalen:	Length of UDP payload
  * @now:	Current timestamp
  *
  * Return: size of tap frame with headers
  */
 static size_t udp_update_hdr6(const struct ctx *c, struct udp6_l2_buf_t *b,
-			      in_port_t dstport, size_t datalen,
+			      in_port_t dstport, uint8_t tclass, size_t datalen,
 			      const struct timespec *now)
 {
 	const struct in6_addr *src = &b->s_in6.sin6_addr;
@@ -668,6 +744,7 @@ static size_t udp_update_hdr6(const struct ctx *c, struct udp6_l2_buf_t *b,
 	b->ip6h.daddr = *dst;
 	b->ip6h.saddr = *src;
 	b->ip6h.version = 6;
+	IP6_SET_TCLASS(&b->ip6h, tclass);
 	b->ip6h.nexthdr = IPPROTO_UDP;
 	b->ip6h.hop_limit = 255;
 
@@ -680,7 +757,7 @@ static size_t udp_update_hdr6(const struct ctx *c, struct udp6_l2_buf_t *b,
 }
 
 /**
- * udp_tap_send() - Prepare UDP datagrams and send to tap interface
+ * udp_tap_send() - Prepare UDP datagrams and queue them to tap interface
  * @c:		Execution context
  * @start:	Index of first datagram in udp[46]_l2_buf pool
  * @n:		Number of datagrams to send
@@ -705,17 +782,25 @@ static void udp_tap_send(const struct ctx *c,
 	for (i = start; i < start + n; i++) {
 		size_t buf_len;
 
-		if (v6)
+		if (v6) {
+			const struct mmsghdr *mm = &udp6_l2_mh_sock[i];
+
 			buf_len = udp_update_hdr6(c, &udp6_l2_buf[i], dstport,
-						  udp6_l2_mh_sock[i].msg_len, now);
-		else
+						  udp_cmsg_tos(&mm->msg_hdr),
+						  mm->msg_len, now);
+		} else {
+			const struct mmsghdr *mm = &udp4_l2_mh_sock[i];
+
 			buf_len = udp_update_hdr4(c, &udp4_l2_buf[i], dstport,
-						  udp4_l2_mh_sock[i].msg_len, now);
+						  udp_cmsg_tos(&mm->msg_hdr),
+						  mm->msg_len, now);
+		}
 
 		tap_iov[i].iov_len = buf_len;
+		tap_queue(c, &tap_iov[i], NULL, 0);
 	}
 
-	tap_send_frames(c, tap_iov + start, 1, n);
+	udp_tap_queued = true;
 }
 
 /**
@@ -730,15 +815,7 @@ static void udp_tap_send(const struct ctx *c,
 void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
 		      const struct timespec *now)
 {
-	/* For not entirely clear reasons (data locality?) pasta gets
-	 * better throughput if we receive tap datagrams one at a
-	 * atime.  For small splice datagrams throughput is slightly
-	 * better if we do batch, but it's slightly worse for large
-	 * splice datagrams.  Since we don't know before we receive
-	 * whether we'll use tap or splice, always go one at a time
-	 * for pasta mode.
-	 */
-	ssize_t n = (c->mode == MODE_PASST ? UDP_MAX_FRAMES : 1);
+	ssize_t n = udp_recv_batch;
 	in_port_t dstport = ref.udp.port;
 	bool v6 = ref.udp.v6;
 	struct mmsghdr *mmh_recv;
@@ -760,6 +837,15 @@ void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
 		udp4_localname.sin_port = htons(dstport);
 	}
 
+	for (i = 0; i < n; i++)
+		mmh_recv[i].msg_hdr.msg_controllen = UDP_CMSG_LEN;
+
+	/* Frames queued to tap might still point to our buffers */
+	if (udp_tap_queued) {
+		tap_flush(c);
+		udp_tap_queued = false;
+	}
+
 	n = recvmmsg(ref.fd, mmh_recv, n, 0, NULL);
 	if (n <= 0)
 		return;
@@ -788,6 +874,171 @@ void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
 	}
 }
 
+/**
+ * udp_tap_set_tos() - Set TOS or Traffic Class on socket, if it changed
+ * @port:	Port tracking entry for the socket
+ * @v6:		Set for IPv6 socket
+ * @tos:	IPv4 Type of Service or IPv6 Traffic Class
+ */
+static void udp_tap_set_tos(struct udp_tap_port *port, bool v6, uint8_t tos)
+{
+	int v = tos;
+
+	if (port->tos == tos)
+		return;
+
+	if (v6)
+		setsockopt(port->sock, IPPROTO_IPV6, IPV6_TCLASS, &v, sizeof(v));
+	else
+		setsockopt(port->sock, IPPROTO_IP, IP_TOS, &v, sizeof(v));
+
+	port->tos = tos;
+}
+
+/**
+ * udp_pace_add() - Hold back datagram from guest until --rate-limit allows it
+ * @v6:		Set for IPv6
+ * @src:	Source port
+ * @tos:	IPv4 Type of Service or IPv6 Traffic Class
+ * @sa:		Destination address
+ * @sl:		Length of @sa
+ * @data:	Payload
+ * @len:	Payload length
+ *
+ * If the queue is full, the datagram is dropped, as the guest sends faster
+ * than the configured rate for longer than we can reasonably buffer.
+ */
+static void udp_pace_add(bool v6, in_port_t src, uint8_t tos,
+			 const struct sockaddr *sa, socklen_t sl,
+			 const void *data, size_t len)
+{
+	struct udp_pace_entry *e;
+	size_t end = 0;
+
+	if (udp_pace_tail)
+		end = udp_pace[udp_pace_tail - 1].off +
+		      udp_pace[udp_pace_tail - 1].len;
+
+	if ((udp_pace_tail == UDP_PACE_FRAMES || end + len > UDP_PACE_BUF_SIZE)
+	    && udp_pace_head) {
+		size_t start = udp_pace[udp_pace_head].off;
+		unsigned int i;
+
+		memmove(udp_pace_buf, udp_pace_buf + start, end - start);
+		memmove(udp_pace, udp_pace + udp_pace_head,
+			(udp_pace_tail - udp_pace_head) * sizeof(*udp_pace));
+
+		udp_pace_tail -= udp_pace_head;
+		udp_pace_head = 0;
+		for (i = 0; i < udp_pace_tail; i++)
+			udp_pace[i].off -= start;
+		end -= start;
+	}
+
+	if (udp_pace_tail == UDP_PACE_FRAMES || end + len > UDP_PACE_BUF_SIZE) {
+		udp_pace_dropped++;
+		return;
+	}
+
+	e = &udp_pace[udp_pace_tail++];
+	memcpy(&e->addr, sa, sl);
+	memcpy(udp_pace_buf + end, data, len);
+	e->off = end;
+	e->len = len;
+	e->src = src;
+	e->v6 = v6;
+	e->tos = tos;
+}
+
+/**
+ * udp_pace_flush() - Send datagrams held back by --rate-limit, as tokens allow
+ * @c:		Execution context
+ *
+ * #syscalls sendmmsg
+ */
+void udp_pace_flush(struct ctx *c)
+{
+	struct mmsghdr mm[UIO_MAXIOV];
+	struct iovec m[UIO_MAXIOV];
+
+	while (udp_pace_head < udp_pace_tail && c->tap_rate.tokens > 0) {
+		const struct udp_pace_entry *e = &udp_pace[udp_pace_head];
+		struct udp_tap_port *port = &udp_tap_map[e->v6][e->src];
+		int64_t budget = c->tap_rate.tokens;
+		unsigned int i;
+		int n, sent;
+
+		/* Batch datagrams for the same socket and TOS, within budget */
+		for (i = udp_pace_head, n = 0;
+		     i < udp_pace_tail && n < UIO_MAXIOV && budget > 0;
+		     i++, n++) {
+			const struct udp_pace_entry *f = &udp_pace[i];
+
+			if (f->v6 != e->v6 || f->src != e->src ||
+			    f->tos != e->tos)
+				break;
+
+			m[n].iov_base = udp_pace_buf + f->off;
+			m[n].iov_len = f->len;
+
+			mm[n].msg_hdr = (struct msghdr) {
+				.msg_name = (void *)&f->addr,
+				.msg_namelen = f->v6 ? sizeof(f->addr.sa6) :
+						       sizeof(f->addr.sa4),
+				.msg_iov = m + n,
+				.msg_iovlen = 1,
+			};
+
+			budget -= f->len;
+		}
+
+		if (port->sock < 0) {		/* Socket expired meanwhile */
+			udp_pace_dropped += n;
+			udp_pace_head += n;
+			continue;
+		}
+
+		udp_tap_set_tos(port, e->v6, e->tos);
+
+		sent = sendmmsg(port->sock, mm, n, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			udp_pace_dropped++;
+			udp_pace_head++;
+			continue;
+		}
+
+		for (i = 0; i < (unsigned int)sent; i++)
+			rate_take(&c->tap_rate, udp_pace[udp_pace_head + i].len);
+
+		udp_pace_head += sent;
+	}
+
+	if (udp_pace_head == udp_pace_tail)
+		udp_pace_head = udp_pace_tail = 0;
+}
+
+/**
+ * udp_pace_timeout() - Get time until held back datagrams can be sent
+ * @c:		Execution context
+ *
+ * Return: milliseconds until tokens are available, -1 if nothing is held back
+ */
+int udp_pace_timeout(const struct ctx *c)
+{
+	int64_t missing;
+
+	if (udp_pace_head == udp_pace_tail)
+		return -1;
+
+	if ((missing = 1 - c->tap_rate.tokens) <= 0)
+		return 0;
+
+	return DIV_ROUND_UP(missing * 1000, (int64_t)c->tap_rate.rate);
+}
+
 /**
  * udp_tap_handler() - Handle packets from tap
  * @c:		Execution context
@@ -795,6 +1046,7 @@ void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
  * @af:		Address family, AF_INET or AF_INET6
  * @saddr:	Source address
  * @daddr:	Destination address
+ * @tos:	IPv4 Type of Service or IPv6 Traffic Class, same for all packets
  * @p:		Pool of UDP packets, with UDP headers
  * @idx:	Index of first packet to process
  * @now:	Current timestamp
@@ -805,13 +1057,16 @@ void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
  */
 int udp_tap_handler(struct ctx *c, uint8_t pif,
 		    sa_family_t af, const void *saddr, const void *daddr,
-		    const struct pool *p, int idx, const struct timespec *now)
+		    uint8_t tos, const struct pool *p, int idx,
+		    const struct timespec *now)
 {
 	struct mmsghdr mm[UIO_MAXIOV];
 	struct iovec m[UIO_MAXIOV];
 	struct sockaddr_in6 s_in6;
 	struct sockaddr_in s_in;
 	const struct udphdr *uh;
+	int64_t budget = c->tap_rate.tokens;
+	bool limited = false;
 	struct sockaddr *sa;
 	int i, s, count = 0;
 	in_port_t src, dst;
@@ -821,9 +1076,7 @@ int udp_tap_handler(struct ctx *c, uint8_t pif,
 	(void)saddr;
 	(void)pif;
 
-	uh = packet_get(p, idx, 0, sizeof(*uh), NULL);
-	if (!uh)
-		return 1;
+	uh = packet_hdr(p, idx, NULL);
 
 	/* The caller already checks that all the messages have the same source
 	 * and destination, so we can just take those from the first message.
@@ -878,9 +1131,12 @@ int udp_tap_handler(struct ctx *c, uint8_t pif,
 				return p->count - idx;
 
 			udp_tap_map[V4][src].sock = s;
+			udp_tap_map[V4][src].tos = 0;
 			bitmap_set(udp_act[V4][UDP_ACT_TAP], src);
 		}
 
+		udp_tap_set_tos(&udp_tap_map[V4][src], false, tos);
+
 		udp_tap_map[V4][src].ts = now->tv_sec;
 	} else {
 		s_in6 = (struct sockaddr_in6) {
@@ -933,27 +1189,45 @@ int udp_tap_handler(struct ctx *c, uint8_t pif,
 				return p->count - idx;
 
 			udp_tap_map[V6][src].sock = s;
+			udp_tap_map[V6][src].tos = 0;
 			bitmap_set(udp_act[V6][UDP_ACT_TAP], src);
 		}
 
+		udp_tap_set_tos(&udp_tap_map[V6][src], true, tos);
+
 		udp_tap_map[V6][src].ts = now->tv_sec;
 	}
 
+	/* As for TCP connections, don't limit traffic to local addresses */
+	if (c->tap_rate.rate) {
+		if (af == AF_INET)
+			limited = !IN4_IS_ADDR_LOOPBACK(&s_in.sin_addr) &&
+				  nl_addr_local(AF_INET, &s_in.sin_addr) != 1;
+		else
+			limited = !IN6_IS_ADDR_LOOPBACK(&s_in6.sin6_addr) &&
+				  nl_addr_local(AF_INET6,
+						&s_in6.sin6_addr) != 1;
+	}
+
 	for (i = 0; i < (int)p->count - idx; i++) {
 		struct udphdr *uh_send;
 		size_t len;
 
-		uh_send = packet_get(p, idx + i, 0, sizeof(*uh), &len);
-		if (!uh_send)
-			return p->count - idx;
+		uh_send = packet_hdr(p, idx + i, NULL);
+		packet_data(p, idx + i, &len);
+
+		/* Over --rate-limit, or others are held back: keep ordering */
+		if (limited && (budget <= 0 || udp_pace_head != udp_pace_tail))
+			break;
+		budget -= len;
 
 		mm[i].msg_hdr.msg_name = sa;
 		mm[i].msg_hdr.msg_namelen = sl;
 
-		if (len) {
-			m[i].iov_base = (char *)(uh_send + 1);
-			m[i].iov_len = len;
+		m[i].iov_base = (char *)(uh_send + 1);
+		m[i].iov_len = len;
 
+		if (len) {
 			mm[i].msg_hdr.msg_iov = m + i;
 			mm[i].msg_hdr.msg_iovlen = 1;
 		} else {
@@ -968,10 +1242,27 @@ int udp_tap_handler(struct ctx *c, uint8_t pif,
 		count++;
 	}
 
+	if (!count) {
+		for (i = 0; i < (int)p->count - idx; i++) {
+			const struct udphdr *uh_send = packet_hdr(p, idx + i,
+								  NULL);
+			size_t len;
+
+			packet_data(p, idx + i, &len);
+			udp_pace_add(af == AF_INET6, src, tos, sa, sl,
+				     uh_send + 1, len);
+		}
+
+		return p->count - idx;
+	}
+
 	count = sendmmsg(s, mm, count, MSG_NOSIGNAL);
 	if (count < 0)
 		return 1;
 
+	for (i = 0; limited && i < count; i++)
+		rate_take(&c->tap_rate, m[i].iov_len);
+
 	return count;
 }
 
@@ -1201,6 +1492,12 @@ void udp_timer(struct ctx *c, const struct timespec *now)
 		}
 	}
 
+	if (udp_pace_dropped) {
+		debug("UDP: dropped %lu datagrams held back by --rate-limit",
+		      udp_pace_dropped);
+		udp_pace_dropped = 0;
+	}
+
 	if (!c->ifi4)
 		v6 = 1;
 v6:
@@ -1230,6 +1527,16 @@ v6:
  */
 int udp_init(struct ctx *c)
 {
+	/* For not entirely clear reasons (data locality?) pasta gets
+	 * better throughput if we receive tap datagrams one at a
+	 * atime.  For small splice datagrams throughput is slightly
+	 * better if we do batch, but it's slightly worse for large
+	 * splice datagrams.  Since we don't know before we receive
+	 * whether we'll use tap or splice, always go one at a time
+	 * for pasta mode.
+	 */
+	udp_recv_batch = c->mode == MODE_PASST ? UDP_MAX_FRAMES : 1;
+
 	udp_sock_iov_init(c);
 
 	udp_invert_portmap(&c->udp.fwd_in);
@@ -24,7 +24,11 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 
 #include "util.h"
 #include "iov.h"
@@ -132,6 +136,19 @@ int sock_l4(const struct ctx *c, sa_family_t af, uint8_t proto,
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)))
 		debug("Failed to set SO_REUSEADDR on socket %i", fd);
 
+	/* Pass ECN marks, and DSCP, of received datagrams on to guest */
+	if (proto == IPPROTO_UDP) {
+		if ((af == AF_INET || dual_stack) &&
+		    setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &y, sizeof(y)))
+			debug("Failed to set IP_RECVTOS on socket %i", fd);
+
+		if (af == AF_INET6 &&
+		    setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &y, sizeof(y)))
+			debug("Failed to set IPV6_RECVTCLASS on socket %i", fd);
+	}
+
+	sock_set_busy_poll(c, fd);
+
 	if (ifname && *ifname) {
 		/* Supported since kernel version 5.7, commit c427bfec18f2
 		 * ("net: core: enable SO_BINDTODEVICE for non-root users"). If
@@ -179,6 +196,31 @@ int sock_l4(const struct ctx *c, sa_family_t af, uint8_t proto,
 	return fd;
 }
 
+/**
+ * sock_set_busy_poll() - Enable busy polling on socket, if configured
+ * @c:		Execution context
+ * @s:		Socket
+ *
+ * Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN: without
+ * it, we'll just poll from the main loop, see main()
+ */
+void sock_set_busy_poll(const struct ctx *c, int s)
+{
+	int v = c->busy_poll;
+
+	if (!v)
+		return;
+
+	if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &v, sizeof(v)))
+		trace("Failed to set SO_BUSY_POLL on socket %i", s);
+
+#ifdef SO_PREFER_BUSY_POLL
+	v = 1;
+	if (setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, &v, sizeof(v)))
+		trace("Failed to set SO_PREFER_BUSY_POLL on socket %i", s);
+#endif
+}
+
 /**
  * sock_probe_mem() - Check if setting high SO_SNDBUF and SO_RCVBUF is allowed
  * @c:		Execution context
@@ -209,6 +251,19 @@ void sock_probe_mem(struct ctx *c)
 }
 
 
+/**
+ * timespec_diff_us() - Report difference in microseconds between two timestamps
+ * @a:		Minuend timestamp
+ * @b:		Subtrahend timestamp
+ *
+ * Return: difference in microseconds
+ */
+long long timespec_diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_nsec - b->tv_nsec) / 1000 +
+	       (a->tv_sec - b->tv_sec) * 1000000LL;
+}
+
 /**
  * timespec_diff_ms() - Report difference in milliseconds between two timestamps
  * @a:		Minuend timestamp
@@ -227,6 +282,36 @@ int timespec_diff_ms(const struct timespec *a, const struct timespec *b)
 	       (a->tv_sec - b->tv_sec) * 1000;
 }
 
+/**
+ * rate_refill() - Add tokens to bucket for the time elapsed since last refill
+ * @b:		Token bucket
+ * @now:	Current timestamp
+ *
+ * Tokens are never reset: debt from overdrawn buckets is repaid, not forgiven.
+ * If the elapsed time isn't worth a single token, keep the previous timestamp,
+ * so that frequent calls don't starve buckets with low rates.
+ */
+void rate_refill(struct rate_bucket *b, const struct timespec *now)
+{
+	long long us;
+	int64_t add;
+
+	if (!b->last.tv_sec && !b->last.tv_nsec) {	/* First refill */
+		b->last = *now;
+		return;
+	}
+
+	us = MIN(timespec_diff_us(now, &b->last), RATE_REFILL_MAX_US);
+	if (us < 0)
+		return;
+
+	if (!(add = us * b->rate / 1000000) && b->tokens < b->burst)
+		return;
+
+	b->tokens = MIN(b->tokens + add, b->burst);
+	b->last = *now;
+}
+
 /**
  * bitmap_set() - Set single bit in bitmap
  * @map:	Pointer to bitmap
@@ -287,6 +372,14 @@ void bitmap_or(uint8_t *dst, size_t size, const uint8_t *a, const uint8_t *b)
 		dst[i] = a[i] | b[i];
 }
 
+/* Persistent helper process in the target namespace, see ns_helper_init() */
+#define NS_HELPER_TIMEOUT_S	1	/* Check helper liveness every x s */
+
+static pid_t ns_helper_pid;
+static pid_t ns_helper_ppid;
+static int ns_helper_fd[2] = { -1, -1 };
+static bool ns_helper_running;	/* Set by helper while serving a request */
+
 /*
  * ns_enter() - Enter configured user (unless already joined) and network ns
  * @c:		Execution context
@@ -297,6 +390,9 @@ void bitmap_or(uint8_t *dst, size_t size, const uint8_t *a, const uint8_t *b)
  */
 void ns_enter(const struct ctx *c)
 {
+	if (ns_helper_running)
+		return;
+
 	if (setns(c->pasta_netns_fd, CLONE_NEWNET))
 		die("setns() failed entering netns: %s", strerror(errno));
 }
@@ -374,11 +470,195 @@ int open_in_ns(const struct ctx *c, const char *path, int flags)
 		.c = c, .path = path, .flags = flags,
 	};
 
-	NS_CALL(do_open_in_ns, &arg);
+	if (NS_CALL(do_open_in_ns, &arg))
+		return -1;
+
 	errno = arg.err;
 	return arg.fd;
 }
 
+/**
+ * struct ns_helper_req - Request for persistent namespace helper
+ * @fn:		Function to call in the namespace
+ * @arg:	Argument for @fn
+ */
+struct ns_helper_req {
+	int (*fn)(void *);
+	void *arg;
+};
+
+/**
+ * ns_helper() - Loop of persistent helper: run requested functions in netns
+ * @arg:	Execution context
+ *
+ * Return: 0, once the parent goes away (never, in practice: it's SIGKILLed)
+ *
+ * #syscalls:pasta prctl getppid
+ */
+static int ns_helper(void *arg)
+{
+	const struct ctx *c = (const struct ctx *)arg;
+	struct ns_helper_req req;
+	int fd = ns_helper_fd[1];
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != ns_helper_ppid)
+		_exit(EXIT_SUCCESS);
+
+	ns_enter(c);
+
+	for (;;) {
+		ssize_t n = read(fd, &req, sizeof(req));
+		int rc;
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n != sizeof(req))
+			break;
+
+		ns_helper_running = true;
+		rc = req.fn(req.arg);
+		ns_helper_running = false;
+
+		if (write(fd, &rc, sizeof(rc)) != sizeof(rc))
+			break;
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * ns_helper_init() - Start persistent helper process in pasta namespace
+ * @c:		Execution context
+ *
+ * The helper shares memory and file descriptor table with us, just like
+ * NS_CALL() children do, but it's created (and it joins the namespace) once:
+ * afterwards, NS_CALL() costs a message round-trip on a socketpair, instead of
+ * a clone(), a setns() and an exit. Must be called after daemonising, and not
+ * at all if we can't use it: NS_CALL() then falls back to clone().
+ *
+ * #syscalls:pasta socketpair getpid
+ */
+void ns_helper_init(const struct ctx *c)
+{
+	static char ns_helper_stack[NS_FN_STACK_SIZE];
+	struct timeval tv = { .tv_sec = NS_HELPER_TIMEOUT_S };
+	int pid;
+
+	if (c->mode != MODE_PASTA)
+		return;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+		       ns_helper_fd)) {
+		warn("Can't create socket pair for namespace helper: %s",
+		     strerror(errno));
+		return;
+	}
+
+	if (setsockopt(ns_helper_fd[0], SOL_SOCKET, SO_RCVTIMEO,
+		       &tv, sizeof(tv)))
+		goto fail;
+
+	ns_helper_ppid = getpid();
+	pid = do_clone(ns_helper, ns_helper_stack, sizeof(ns_helper_stack),
+		       CLONE_VM | CLONE_FILES | SIGCHLD, (void *)c);
+	if (pid < 0)
+		goto fail;
+
+	ns_helper_pid = pid;
+	debug("Namespace helper started, PID %i", pid);
+	return;
+
+fail:
+	warn("Can't start namespace helper: %s", strerror(errno));
+	close(ns_helper_fd[0]);
+	close(ns_helper_fd[1]);
+	ns_helper_fd[0] = ns_helper_fd[1] = -1;
+}
+
+/**
+ * ns_helper_call() - Run function in namespace using persistent helper
+ * @fn:		Function to call, same semantics as for NS_CALL()
+ * @arg:	Argument for @fn
+ *
+ * Return: 0 if @fn was run by the helper, 1 if the helper is not available and
+ *	   the request wasn't delivered, so that the caller can clone() instead,
+ *	   -1 if the helper went away after receiving the request: @fn might have
+ *	   run, fully or partially, and it must not be called again
+ *
+ * #syscalls:pasta kill
+ */
+static int ns_helper_call(int (*fn)(void *), void *arg)
+{
+	struct ns_helper_req req = { .fn = fn, .arg = arg };
+	bool sent = false;
+	ssize_t n;
+	int rc;
+
+	if (!ns_helper_pid)
+		return 1;
+
+	if (send(ns_helper_fd[0], &req, sizeof(req), 0) != sizeof(req))
+		goto dead;
+
+	sent = true;
+	while ((n = recv(ns_helper_fd[0], &rc, sizeof(rc), 0)) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			goto dead;
+
+		if (kill(ns_helper_pid, 0))
+			goto dead;
+	}
+
+	if (n != sizeof(rc))
+		goto dead;
+
+	return 0;
+
+dead:
+	close(ns_helper_fd[0]);
+	close(ns_helper_fd[1]);
+	ns_helper_fd[0] = ns_helper_fd[1] = -1;
+	ns_helper_pid = 0;
+
+	/* Shared with the helper: clear it, or clone()d children skip setns() */
+	ns_helper_running = false;
+
+	if (sent) {
+		err("Namespace helper gone while running request");
+		return -1;
+	}
+
+	warn("Namespace helper gone, falling back to clone()");
+	return 1;
+}
+
+/**
+ * ns_call() - Run function in pasta namespace, via helper or clone()
+ * @fn:		Function to call, calling ns_enter() first
+ * @arg:	Argument for @fn
+ *
+ * Return: 0 once @fn returned, -1 with errno set if it couldn't be run, or if
+ *	   it might have been interrupted
+ */
+int ns_call(int (*fn)(void *), void *arg)
+{
+	char ns_fn_stack[NS_FN_STACK_SIZE];
+	int rc;
+
+	if ((rc = ns_helper_call(fn, arg)) <= 0) {
+		if (rc)
+			errno = EIO;
+		return rc;
+	}
+
+	if (do_clone(fn, ns_fn_stack, sizeof(ns_fn_stack),
+		     CLONE_VM | CLONE_VFORK | CLONE_FILES | SIGCHLD, arg) < 0)
+		return -1;
+
+	return 0;
+}
+
 /**
  * pid_file() - Write PID to file, if requested to do so, and close it
  * @fd:		Open PID file descriptor, closed on exit, -1 to skip writing it
@@ -490,6 +770,37 @@ int write_file(const char *path, const char *buf)
 	return len == 0 ? 0 : -1;
 }
 
+/**
+ * read_file_integer() - Read a single integer value from a file
+ * @path:	File to read
+ * @fallback:	Value returned if the file can't be read or parsed
+ *
+ * Return: integer value read from @path, @fallback on any error
+ */
+intmax_t read_file_integer(const char *path, intmax_t fallback)
+{
+	char buf[sizeof("-9223372036854775808\n")] = { 0 };
+	intmax_t value;
+	ssize_t n;
+	char *end;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return fallback;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return fallback;
+
+	errno = 0;
+	value = strtoimax(buf, &end, 10);
+	if (errno || end == buf)
+		return fallback;
+
+	return value;
+}
+
 #ifdef __ia64__
 /* Needed by do_clone() below: glibc doesn't export the prototype of __clone2(),
  * use the description from clone(2).
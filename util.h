@@ -114,14 +114,8 @@
 #define NS_FN_STACK_SIZE	(RLIMIT_STACK_VAL * 1024 / 8)
 int do_clone(int (*fn)(void *), char *stack_area, size_t stack_size, int flags,
 	     void *arg);
-#define NS_CALL(fn, arg)						\
-	do {								\
-		char ns_fn_stack[NS_FN_STACK_SIZE];			\
-									\
-		do_clone((fn), ns_fn_stack, sizeof(ns_fn_stack),	\
-			 CLONE_VM | CLONE_VFORK | CLONE_FILES | SIGCHLD,\
-			 (void *)(arg));				\
-	} while (0)
+int ns_call(int (*fn)(void *), void *arg);
+#define NS_CALL(fn, arg)	ns_call((fn), (void *)(arg))
 
 #define RCVBUF_BIG		(2UL * 1024 * 1024)
 #define SNDBUF_BIG		(4UL * 1024 * 1024)
@@ -135,13 +129,44 @@ int do_clone(int (*fn)(void *), char *stack_area, size_t stack_size, int flags,
 
 struct ctx;
 
+#define RATE_MAX		(1ULL << 37)	/* bytes per second */
+#define RATE_REFILL_MAX_US	1000000	/* max time accounted for per refill */
+
+/**
+ * struct rate_bucket - Token bucket for rate limiting
+ * @rate:	Refill rate in bytes per second, 0 if not limited
+ * @burst:	Bucket size, bytes
+ * @tokens:	Bytes that can be sent, negative if overdrawn
+ * @last:	Time of last refill
+ */
+struct rate_bucket {
+	uint64_t rate;
+	int64_t burst;
+	int64_t tokens;
+	struct timespec last;
+};
+
+/**
+ * rate_take() - Account for data sent against token bucket, if limited
+ * @b:		Token bucket
+ * @len:	Bytes sent
+ */
+static inline void rate_take(struct rate_bucket *b, size_t len)
+{
+	if (b->rate)
+		b->tokens -= len;
+}
+
 /* cppcheck-suppress funcArgNamesDifferent */
 //__attribute__ ((weak)) int ffsl(long int i) { return __builtin_ffsl(i); }
 int sock_l4(const struct ctx *c, sa_family_t af, uint8_t proto,
 	    const void *bind_addr, const char *ifname, uint16_t port,
 	    uint32_t data);
+void sock_set_busy_poll(const struct ctx *c, int s);
 void sock_probe_mem(struct ctx *c);
+long long timespec_diff_us(const struct timespec *a, const struct timespec *b);
 int timespec_diff_ms(const struct timespec *a, const struct timespec *b);
+void rate_refill(struct rate_bucket *b, const struct timespec *now);
 void bitmap_set(uint8_t *map, int bit);
 void bitmap_clear(uint8_t *map, int bit);
 int bitmap_isset(const uint8_t *map, int bit);
@@ -150,10 +175,12 @@ char *line_read(char *buf, size_t len, int fd);
 void ns_enter(const struct ctx *c);
 bool ns_is_init(void);
 int open_in_ns(const struct ctx *c, const char *path, int flags);
+void ns_helper_init(const struct ctx *c);
 void write_pidfile(int fd, pid_t pid);
 int __daemon(int pidfile_fd, int devnull_fd);
 int fls(unsigned long x);
 int write_file(const char *path, const char *buf);
+intmax_t read_file_integer(const char *path, intmax_t fallback);
 int write_remainder(int fd, const struct iovec *iov, int iovcnt, size_t skip);
 
 /**